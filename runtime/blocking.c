@@ -0,0 +1,160 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Offload pool for the blocking calls
+//
+// Some calls block the thread whatever flags the descriptor has: open
+// and stat on a slow disk, fsync, getaddrinfo, the file reads when
+// there is no io_uring. task_blocking parks the task and hands the call
+// over to a pool of plain threads, the thread of the task goes on with
+// the others meanwhile. the pool grows when the requests queue up, up
+// to BLOCKING_MAX threads, and a thread idle for BLOCKING_IDLE_NS exits.
+
+#include <pthread.h>
+#include <limits.h>
+#include <errno.h>
+#include "task.h"
+#include "runtime.h"
+
+#define BLOCKING_MAX 64
+#define BLOCKING_IDLE_NS 5000000000LL
+
+struct blockreq {
+	struct list_head link;
+	struct task *task;
+	void *(*fn)(void *arg);
+	void *arg;
+	void *ret;
+	int err;		// errno after fn
+	int inplace;		// no pool thread, the task calls fn itself
+};
+
+static struct {
+	// Lock must be the first field
+	struct spinlock Lock;
+	struct list_head queue;
+	int nqueue;
+	int nthreads;
+	int nidle;
+	int shutdown;
+	unsigned int seq;	// the idle threads sleep on it
+} pool;
+
+static pthread_once_t blocking_once = PTHREAD_ONCE_INIT;
+static int blocking_inited;
+
+static void blocking_init(void) {
+	spinlock_init(&pool);
+	INIT_LIST_HEAD(&pool.queue);
+	atomic_store(&blocking_inited, 1);
+}
+
+static void *blocking_main(void *arg) {
+	struct blockreq *req;
+	long long now, idle = 0;
+	unsigned int seq;
+
+	(void)arg;
+	// spawned by a scheduler thread, don't stay on its cpu
+	sys_thread_unbind();
+	spin_lock(&pool);
+	for (;;) {
+		if (!list_empty(&pool.queue)) {
+			req = list_first(&pool.queue, struct blockreq, link);
+			list_del(&req->link);
+			pool.nqueue--;
+			spin_unlock(&pool);
+			errno = 0;
+			req->ret = req->fn(req->arg);
+			req->err = errno;
+			task_ready(req->task);
+			idle = 0;
+			spin_lock(&pool);
+			continue;
+		}
+		now = nanotime();
+		if (pool.shutdown || (idle && now >= idle))
+			break;
+		if (!idle)
+			idle = now + BLOCKING_IDLE_NS;
+		seq = pool.seq;
+		pool.nidle++;
+		spin_unlock(&pool);
+		futexsleep(&pool.seq, seq, idle - now);
+		spin_lock(&pool);
+		pool.nidle--;
+	}
+	pool.nthreads--;
+	spin_unlock(&pool);
+	return NULL;
+}
+
+// Queue the request once the task is parked, so the pool can't make it
+// runnable before its context is saved.
+static int blocking_submit(struct task *t, void *arg) {
+	struct blockreq *req = arg;
+	pthread_attr_t attr;
+	pthread_t pid;
+	int wake, spawn = 0;
+
+	(void)t;
+	spin_lock(&pool);
+	list_add_tail(&req->link, &pool.queue);
+	pool.nqueue++;
+	pool.seq++;
+	wake = pool.nidle;
+	if (pool.nqueue > pool.nidle && pool.nthreads < BLOCKING_MAX) {
+		pool.nthreads++;
+		spawn = 1;
+	}
+	spin_unlock(&pool);
+	if (wake)
+		futexwakeup(&pool.seq, 1);
+	if (!spawn)
+		return 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	spawn = pthread_create(&pid, &attr, blocking_main, NULL);
+	pthread_attr_destroy(&attr);
+	if (spawn == 0)
+		return 1;
+	spin_lock(&pool);
+	pool.nthreads--;
+	if (pool.nthreads > 0) {
+		spin_unlock(&pool);
+		return 1;
+	}
+	// nobody to serve it, take it back
+	list_del(&req->link);
+	pool.nqueue--;
+	spin_unlock(&pool);
+	req->inplace = 1;
+	return 0;
+}
+
+void *task_blocking(void *(*fn)(void *arg), void *arg) {
+	struct blockreq req;
+
+	if (!(req.task = task_current()))
+		return fn(arg);
+	pthread_once(&blocking_once, blocking_init);
+	req.fn = fn;
+	req.arg = arg;
+	req.inplace = 0;
+	task_park(blocking_submit, &req);
+	if (req.inplace)
+		return fn(arg);
+	errno = req.err;
+	return req.ret;
+}
+
+// The last task stopped, let the idle threads go.
+void blocking_shutdown(void) {
+	if (!atomic_load(&blocking_inited))
+		return;
+	spin_lock(&pool);
+	pool.shutdown = 1;
+	pool.seq++;
+	spin_unlock(&pool);
+	futexwakeup(&pool.seq, INT_MAX);
+}
@@ -0,0 +1,464 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Channels
+//
+// A channel is a ring buffer of elements and two queues of the parked
+// senders and receivers, all under the channel lock. a sender finding
+// a parked receiver copies the element straight into the receiver's
+// buffer and makes it runnable on the local run queue, and the other
+// way round, so a handoff costs no trip through the buffer or the
+// global queue. a receiver taking from a full buffer refills it from
+// the first parked sender.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include "task.h"
+#include "runtime.h"
+#include "chan.h"
+
+struct chan {
+	// Lock must be the first field
+	struct spinlock Lock;
+	int elemsize;
+	int cap;
+	int count;		// elements in the buffer
+	int head;		// next element to receive
+	int closed;
+	struct list_head recvq, sendq;	// parked tasks
+	char *buf;
+};
+
+// A task parked on a channel, the partner copies the element from or
+// into elem before waking it up.
+struct chanwaiter {
+	struct waiter w;
+	void *elem;
+};
+
+struct chan *chan_make(int elemsize, int cap) {
+	struct chan *c;
+
+	if (elemsize < 0 || cap < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(c = malloc(sizeof(*c) + (size_t)elemsize * cap)))
+		return NULL;
+	memset(c, 0, sizeof(*c));
+	spinlock_init(c);
+	c->elemsize = elemsize;
+	c->cap = cap;
+	c->buf = (char *)(c + 1);
+	INIT_LIST_HEAD(&c->recvq);
+	INIT_LIST_HEAD(&c->sendq);
+	return c;
+}
+
+void chan_free(struct chan *c) {
+	spinlock_destroy(c);
+	free(c);
+}
+
+static inline void *chan_slot(struct chan *c, int i) {
+	return c->buf + (size_t)c->elemsize * ((c->head + i) % c->cap);
+}
+
+// Take the first waiter off q which can be woken, the stale waiters of
+// task_select on the way are dropped. *wake is set to the task to make
+// ready once the lock is released, or NULL.
+static struct chanwaiter *chan_dequeue(struct list_head *q, struct task **wake) {
+	struct chanwaiter *cw;
+	int claim;
+
+	while (!list_empty(q)) {
+		cw = list_first(q, struct chanwaiter, w.link);
+		list_del_init(&cw->w.link);
+		if ((claim = waiter_claim(&cw->w))) {
+			*wake = claim == 1 ? cw->w.task : NULL;
+			return cw;
+		}
+	}
+	return NULL;
+}
+
+static int chan_unlock(struct task *t, void *arg) {
+	(void)t;
+	spin_unlock(arg);
+	return 1;
+}
+
+// Park the current task on q, the lock of c is held and released once
+// the task is parked. returns the errno the partner left.
+static int chan_park(struct chan *c, struct list_head *q, void *elem) {
+	struct chanwaiter cw;
+
+	WAITER_INIT(&cw.w);
+	cw.elem = elem;
+	list_add_tail(&cw.w.link, q);
+	task_park(chan_unlock, c);
+	return cw.w.ret;
+}
+
+// Send elem on c if it needn't wait, with the lock of c held. returns 1
+// with the errno in *err once it's done, 0 if the sender has to park.
+static int chan_sendnow(struct chan *c, const void *elem, int *err, struct task **wake) {
+	struct chanwaiter *cw;
+
+	*err = 0;
+	*wake = NULL;
+	if (c->closed) {
+		*err = EPIPE;
+		return 1;
+	}
+	if ((cw = chan_dequeue(&c->recvq, wake))) {
+		// a receiver is waiting, so the buffer is empty
+		memcpy(cw->elem, elem, c->elemsize);
+		return 1;
+	}
+	if (c->count < c->cap) {
+		memcpy(chan_slot(c, c->count), elem, c->elemsize);
+		c->count++;
+		return 1;
+	}
+	return 0;
+}
+
+// Receive from c into elem if it needn't wait, see chan_sendnow.
+static int chan_recvnow(struct chan *c, void *elem, int *err, struct task **wake) {
+	struct chanwaiter *cw;
+
+	*err = 0;
+	*wake = NULL;
+	if ((cw = chan_dequeue(&c->sendq, wake))) {
+		if (c->cap == 0) {
+			memcpy(elem, cw->elem, c->elemsize);
+		} else {
+			// the buffer is full, take the head and put the
+			// sender's element at the tail.
+			memcpy(elem, chan_slot(c, 0), c->elemsize);
+			memcpy(chan_slot(c, 0), cw->elem, c->elemsize);
+			c->head = (c->head + 1) % c->cap;
+		}
+		return 1;
+	}
+	if (c->count > 0) {
+		memcpy(elem, chan_slot(c, 0), c->elemsize);
+		c->head = (c->head + 1) % c->cap;
+		c->count--;
+		return 1;
+	}
+	if (c->closed) {
+		memset(elem, 0, c->elemsize);
+		*err = EPIPE;
+		return 1;
+	}
+	return 0;
+}
+
+static int chan_dosend(struct chan *c, const void *elem, int block) {
+	struct task *wake;
+	int err;
+
+	spin_lock(c);
+	if (chan_sendnow(c, elem, &err, &wake)) {
+		spin_unlock(c);
+		if (wake)
+			task_ready(wake);
+		task_safepoint();
+	} else if (!block) {
+		spin_unlock(c);
+		err = EAGAIN;
+	} else {
+		err = chan_park(c, &c->sendq, (void *)elem);
+	}
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int chan_dorecv(struct chan *c, void *elem, int block) {
+	struct task *wake;
+	int err;
+
+	spin_lock(c);
+	if (chan_recvnow(c, elem, &err, &wake)) {
+		spin_unlock(c);
+		if (wake)
+			task_ready(wake);
+		task_safepoint();
+	} else if (!block) {
+		spin_unlock(c);
+		err = EAGAIN;
+	} else {
+		err = chan_park(c, &c->recvq, elem);
+	}
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int chan_send(struct chan *c, const void *elem) {
+	return chan_dosend(c, elem, 1);
+}
+
+int chan_recv(struct chan *c, void *elem) {
+	return chan_dorecv(c, elem, 1);
+}
+
+int chan_trysend(struct chan *c, const void *elem) {
+	return chan_dosend(c, elem, 0);
+}
+
+int chan_tryrecv(struct chan *c, void *elem) {
+	return chan_dorecv(c, elem, 0);
+}
+
+int chan_close(struct chan *c) {
+	struct list_head q;
+	struct chanwaiter *cw;
+	struct task *wake;
+
+	spin_lock(c);
+	if (c->closed) {
+		spin_unlock(c);
+		errno = EPIPE;
+		return -1;
+	}
+	c->closed = 1;
+	// the buffer is empty if anybody is receiving, and the senders
+	// can't complete anymore. the claimed waiters stay parked until
+	// they are woken, so they can be linked on q without the lock.
+	INIT_LIST_HEAD(&q);
+	while ((cw = chan_dequeue(&c->recvq, &wake))) {
+		memset(cw->elem, 0, c->elemsize);
+		cw->w.ret = EPIPE;
+		if (wake)
+			list_add_tail(&cw->w.link, &q);
+	}
+	while ((cw = chan_dequeue(&c->sendq, &wake))) {
+		cw->w.ret = EPIPE;
+		if (wake)
+			list_add_tail(&cw->w.link, &q);
+	}
+	spin_unlock(c);
+
+	while (!list_empty(&q)) {
+		cw = list_first(&q, struct chanwaiter, w.link);
+		list_del(&cw->w.link);
+		task_ready(cw->w.task);
+	}
+	return 0;
+}
+
+int chan_len(struct chan *c) {
+	return atomic_load(&c->count);
+}
+
+int chan_cap(struct chan *c) {
+	return c->cap;
+}
+
+
+// Select
+//
+// The channels of a select are locked all together in the address
+// order, the ready cases are looked for under the locks in a rotating
+// order, and otherwise a waiter is queued on every channel and fd of
+// the select. the channels stay locked until the task is parked, so a
+// partner can only find the waiters of a parked select. the first case
+// firing claims the select by waiter_claim, the others find it claimed
+// and drop their waiters. an fd or the timeout may fire before the task
+// is parked, it then runs again at once.
+
+struct selectstate {
+	struct selectwait sel;
+	struct chan *locks[SELECT_MAX];
+	int nlocks;
+};
+
+static unsigned int selectseq;
+
+static void select_lock(struct selectstate *ss, struct select_case *cases, int n) {
+	struct chan *c;
+	int i, k;
+
+	ss->nlocks = 0;
+	for (i = 0; i < n; i++) {
+		if (cases[i].op != SELECT_SEND && cases[i].op != SELECT_RECV)
+			continue;
+		c = cases[i].c;
+		for (k = ss->nlocks; k > 0 && ss->locks[k - 1] > c; k--)
+			;
+		if (k > 0 && ss->locks[k - 1] == c)
+			continue;
+		memmove(&ss->locks[k + 1], &ss->locks[k],
+			sizeof(c) * (ss->nlocks - k));
+		ss->locks[k] = c;
+		ss->nlocks++;
+	}
+	for (i = 0; i < ss->nlocks; i++)
+		spin_lock(ss->locks[i]);
+}
+
+static void select_unlock(struct selectstate *ss) {
+	int i;
+
+	for (i = ss->nlocks - 1; i >= 0; i--)
+		spin_unlock(ss->locks[i]);
+}
+
+static int select_commit(struct task *t, void *arg) {
+	struct selectstate *ss = arg;
+	int parked;
+
+	(void)t;
+	parked = atomic_cas(&ss->sel.state, SEL_REGISTERING, SEL_PARKED);
+	select_unlock(ss);
+	return parked;
+}
+
+static void select_timeout(struct timer *tm, void *arg) {
+	struct waiter *w = arg;
+
+	(void)tm;
+	w->ret = ETIMEDOUT;
+	if (waiter_claim(w) == 1)
+		task_ready(w->task);
+}
+
+int task_select(struct select_case *cases, int n, long long timeout) {
+	struct chanwaiter cw[SELECT_MAX];
+	struct pollfd pfd[SELECT_MAX];
+	struct selectstate ss;
+	struct select_case *sc;
+	struct waiter tw;
+	struct timer tm;
+	struct task *wake = NULL;
+	char armed[SELECT_MAX];
+	unsigned int start;
+	int i, k, r, npfd = 0, nreg, fired;
+
+	if (n < 0 || n > SELECT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	// the fds ready at once, their readiness on the poller is only
+	// known once a task waited for them.
+	for (i = 0; i < n; i++) {
+		cases[i].err = 0;
+		if (cases[i].op != SELECT_READ && cases[i].op != SELECT_WRITE)
+			continue;
+		pfd[npfd].fd = cases[i].fd;
+		pfd[npfd].events = cases[i].op == SELECT_READ ? POLLIN : POLLOUT;
+		pfd[npfd].revents = 0;
+		npfd++;
+	}
+	if (npfd && poll(pfd, npfd, 0) < 0)
+		return -1;
+
+	select_lock(&ss, cases, n);
+	start = atomic_add(&selectseq, 1);
+	for (k = 0; k < n; k++) {
+		i = (start + k) % n;
+		sc = &cases[i];
+		switch (sc->op) {
+		case SELECT_SEND:
+			if (chan_sendnow(sc->c, sc->elem, &sc->err, &wake))
+				goto DONE;
+			break;
+		case SELECT_RECV:
+			if (chan_recvnow(sc->c, sc->elem, &sc->err, &wake))
+				goto DONE;
+			break;
+		}
+	}
+	for (i = 0, k = 0; i < n && npfd; i++) {
+		if (cases[i].op != SELECT_READ && cases[i].op != SELECT_WRITE)
+			continue;
+		if (pfd[k].revents & POLLNVAL)
+			cases[i].err = EBADF;
+		if (pfd[k++].revents)
+			goto DONE;
+	}
+	if (timeout == 0) {
+		select_unlock(&ss);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	// wait on all of them
+	ss.sel.state = SEL_REGISTERING;
+	ss.sel.fired = -1;
+	for (nreg = 0; nreg < n; nreg++) {
+		sc = &cases[nreg];
+		WAITER_INIT(&cw[nreg].w);
+		cw[nreg].w.sel = &ss.sel;
+		cw[nreg].w.index = nreg;
+		cw[nreg].elem = sc->elem;
+		INIT_LIST_HEAD(&cw[nreg].w.link);
+		armed[nreg] = 0;
+		if (sc->op == SELECT_SEND) {
+			list_add_tail(&cw[nreg].w.link, &sc->c->sendq);
+			continue;
+		}
+		if (sc->op == SELECT_RECV) {
+			list_add_tail(&cw[nreg].w.link, &sc->c->recvq);
+			continue;
+		}
+		if ((r = netpoll_arm(sc->fd, sc->op == SELECT_READ ? 'r' : 'w', &cw[nreg].w)) == 0) {
+			armed[nreg] = 1;
+			continue;
+		}
+		if (r < 0) {
+			// can't be waited on, report it as ready
+			cw[nreg].w.ret = errno;
+			waiter_claim(&cw[nreg].w);
+		}
+		nreg++;
+		break;
+	}
+	if (timeout > 0) {
+		WAITER_INIT(&tw);
+		tw.sel = &ss.sel;
+		tw.index = -1;
+		tm.when = nanotime() + timeout;
+		tm.f = select_timeout;
+		tm.arg = &tw;
+		if (timer_add(&tm) < 0)
+			timeout = -1;
+	}
+	task_park(select_commit, &ss);
+	fired = ss.sel.fired;
+
+	// drop the waiters of the other cases, and wait for the partner
+	// of the fired case to leave the locks.
+	select_lock(&ss, cases, nreg);
+	for (i = 0; i < nreg; i++)
+		if ((cases[i].op == SELECT_SEND || cases[i].op == SELECT_RECV) &&
+		    !list_empty(&cw[i].w.link))
+			list_del_init(&cw[i].w.link);
+	select_unlock(&ss);
+	for (i = 0; i < nreg; i++)
+		if (armed[i])
+			netpoll_disarm(cases[i].fd, &cw[i].w);
+	if (timeout > 0)
+		timer_del(&tm);
+	if (fired < 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	cases[fired].err = cw[fired].w.ret;
+	return fired;
+
+ DONE:
+	select_unlock(&ss);
+	if (wake)
+		task_ready(wake);
+	return i;
+}
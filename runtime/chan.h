@@ -0,0 +1,53 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+#ifndef _CHAN_H_
+#define _CHAN_H_
+
+// Channels between the tasks, see chan.c. a channel of capacity 0 is
+// unbuffered: the sender parks until a receiver takes the element. the
+// elements are copied by value, elemsize bytes each.
+//
+// The calls return 0 on success, or -1 with errno set: EPIPE if the
+// channel is closed (and drained, for the receivers), EAGAIN if a try
+// variant would have to park.
+
+struct chan;
+
+struct chan *chan_make(int elemsize, int cap);
+// Free a channel, no task may be using it anymore.
+void chan_free(struct chan *c);
+int chan_send(struct chan *c, const void *elem);
+int chan_recv(struct chan *c, void *elem);
+int chan_trysend(struct chan *c, const void *elem);
+int chan_tryrecv(struct chan *c, void *elem);
+// Close a channel, the parked receivers and senders fail with EPIPE,
+// the buffered elements are still delivered.
+int chan_close(struct chan *c);
+int chan_len(struct chan *c);
+int chan_cap(struct chan *c);
+
+// The cases of task_select
+#define SELECT_SEND 1		// send *elem on c
+#define SELECT_RECV 2		// receive from c into *elem
+#define SELECT_READ 3		// fd is readable
+#define SELECT_WRITE 4		// fd is writable
+
+struct select_case {
+	int op;
+	struct chan *c;
+	void *elem;
+	int fd;			// non-blocking, closed by sys_close
+	int err;		// EPIPE if c is closed, EBADF if fd is
+};
+
+#define SELECT_MAX 64
+
+// Wait until one of the n cases can proceed, carry it out and return
+// its index. the channel cases ready at once are taken in a rotating
+// order. a fd case reports readiness only, the read or the write may
+// still find EAGAIN. gives up after timeout nanoseconds, returns -1
+// with errno ETIMEDOUT, or EAGAIN if timeout is 0. a negative timeout
+// waits forever.
+int task_select(struct select_case *cases, int n, long long timeout);
+
+#endif /* _CHAN_H_ */
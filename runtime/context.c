@@ -0,0 +1,151 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+#define _GNU_SOURCE
+#include "context.h"
+#include <ucontext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+
+#ifdef USE_UCONTEXT
+
+int context_init(struct context *ctx, void *stack, size_t size,
+		 void (*fn)(void *), void *arg) {
+	memset(&ctx->uc, 0, sizeof(ctx->uc));
+	if (getcontext(&ctx->uc) < 0)
+		return -1;
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = size;
+	ctx->uc.uc_link = NULL;
+	makecontext(&ctx->uc, (void (*)())fn, 1, arg);
+	return 0;
+}
+
+void context_switch(struct context *from, struct context *to) {
+	if (swapcontext(&from->uc, &to->uc) < 0) {
+		fprintf(stderr, "swapcontext failed\n");
+		abort();
+	}
+}
+
+#else
+
+// the first switch to a new context returns into context_entry, which
+// calls fn(arg) with the registers context_init stores in the frame.
+extern void context_entry(void);
+
+#if defined(__x86_64__)
+
+// the frame context_switch pops, from the lowest address:
+//     mxcsr, x87 control word, r15, r14, r13, r12, rbx, rbp, return address
+// context_entry calls r13(r12).
+
+int context_init(struct context *ctx, void *stack, size_t size,
+		 void (*fn)(void *), void *arg) {
+	uint64_t *sp;
+
+	sp = (uint64_t *)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+	// 8 slots of the frame and 2 zero slots above, so the stack is
+	// 16 bytes aligned again when context_entry calls fn.
+	sp -= 10;
+	if ((void *)sp < stack)
+		return -1;
+	memset(sp, 0, 10 * sizeof(*sp));
+	sp[0] = 0x1f80 | ((uint64_t)0x037f << 32);	// default mxcsr and fpu cw
+	sp[3] = (uint64_t)(uintptr_t)fn;		// r13
+	sp[4] = (uint64_t)(uintptr_t)arg;		// r12
+	sp[7] = (uint64_t)(uintptr_t)context_entry;	// return address
+	ctx->sp = sp;
+	return 0;
+}
+
+#elif defined(__aarch64__)
+
+// the frame context_switch pops, from the lowest address:
+//     x19 ... x28, x29, x30, d8 ... d15
+// context_entry calls x19(x20).
+
+int context_init(struct context *ctx, void *stack, size_t size,
+		 void (*fn)(void *), void *arg) {
+	uint64_t *sp;
+
+	sp = (uint64_t *)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+	sp -= 20;
+	if ((void *)sp < stack)
+		return -1;
+	memset(sp, 0, 20 * sizeof(*sp));
+	sp[0] = (uint64_t)(uintptr_t)fn;		// x19
+	sp[1] = (uint64_t)(uintptr_t)arg;		// x20
+	sp[11] = (uint64_t)(uintptr_t)context_entry;	// x30
+	ctx->sp = sp;
+	return 0;
+}
+
+#else
+#error "no context switch for this arch, build with UCONTEXT=1"
+#endif
+
+#endif /* USE_UCONTEXT */
+
+
+#if defined(__x86_64__) && !defined(USE_UCONTEXT)
+
+#include <cpuid.h>
+
+// the bytes context_preempt_entry saves the fpu and vector registers
+// in, with xsave if the kernel turned it on, or fxsave.
+int context_xsave;
+long context_fpusize = 512;
+
+extern void context_preempt_entry(void);
+
+int context_preempt_init(void) {
+	unsigned int a, b, c, d;
+
+	if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_OSXSAVE) &&
+	    __get_cpuid_count(0xd, 0, &a, &b, &c, &d) && b >= 576) {
+		context_fpusize = (b + 63) & ~63L;
+		context_xsave = 1;
+	}
+	return 0;
+}
+
+void *context_pc(void *uc) {
+	return (void *)((ucontext_t *)uc)->uc_mcontext.gregs[REG_RIP];
+}
+
+// the interrupted code may use the 128 bytes red zone below its stack
+// pointer, the frame goes below it: fn and the return address, which
+// context_preempt_entry pops with ret $128.
+int context_preempt(void *uc, void (*fn)(void)) {
+	greg_t *gregs = ((ucontext_t *)uc)->uc_mcontext.gregs;
+	uint64_t *sp = (uint64_t *)gregs[REG_RSP];
+
+	sp -= 16 + 2;
+	sp[0] = (uint64_t)(uintptr_t)fn;
+	sp[1] = (uint64_t)gregs[REG_RIP];
+	gregs[REG_RSP] = (greg_t)sp;
+	gregs[REG_RIP] = (greg_t)context_preempt_entry;
+	return 0;
+}
+
+#else
+
+int context_preempt_init(void) {
+	return -1;
+}
+
+void *context_pc(void *uc) {
+	(void)uc;
+	return NULL;
+}
+
+int context_preempt(void *uc, void (*fn)(void)) {
+	(void)uc;
+	(void)fn;
+	return -1;
+}
+
+#endif
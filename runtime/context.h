@@ -0,0 +1,49 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+#ifndef _CONTEXT_H_
+#define _CONTEXT_H_
+
+#include <stddef.h>
+
+// Machine context of a task or of the scheduler. the default is the
+// hand written switch in context_$(ARCH).S, which saves only the callee
+// saved registers and the stack pointer. build with -DUSE_UCONTEXT
+// (make UCONTEXT=1) to fall back to swapcontext(3), which also saves
+// the signal mask with a syscall on every switch.
+
+#ifdef USE_UCONTEXT
+#include <ucontext.h>
+
+struct context {
+	ucontext_t uc;
+};
+#else
+struct context {
+	void *sp;
+};
+#endif
+
+// Prepare ctx to run fn(arg) on the stack [stack, stack + size) when
+// it is switched to the first time. fn must never return.
+int context_init(struct context *ctx, void *stack, size_t size,
+		 void (*fn)(void *), void *arg);
+
+// Save the current context into from and resume to.
+#ifdef USE_UCONTEXT
+void context_switch(struct context *from, struct context *to);
+#else
+extern void context_switch(struct context *from, struct context *to);
+#endif
+
+// Asynchronous preemption. context_preempt makes the context a signal
+// interrupted, uc of the SA_SIGINFO handler, call fn() as soon as the
+// handler returns and then go on where it was, with every register as
+// it was. returns -1 where there is no such trampoline: arm64 and the
+// swapcontext build, context_preempt_init tells it up front.
+// context_pc is the interrupted instruction, NULL without the
+// trampoline.
+int context_preempt_init(void);
+void *context_pc(void *uc);
+int context_preempt(void *uc, void (*fn)(void));
+
+#endif /* _CONTEXT_H_ */
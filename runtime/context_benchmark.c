@@ -0,0 +1,88 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Ping-pong between two contexts, compare the context_switch of the
+// runtime with swapcontext(3).
+//
+//     ./context_benchmark.out [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include "context.h"
+
+#define BILLION 1000000000ULL
+#define STACKSIZE (64 * 1024)
+
+static long rounds = 10000000;
+
+static struct context main_ctx, peer_ctx;
+
+static void context_peer(void *args) {
+	(void)args;
+	for (;;)
+		context_switch(&peer_ctx, &main_ctx);
+}
+
+static ucontext_t main_uc, peer_uc;
+
+static void ucontext_peer(void) {
+	for (;;)
+		swapcontext(&peer_uc, &main_uc);
+}
+
+static double elapsed(struct timespec *start, struct timespec *stop) {
+	return (double)(stop->tv_sec - start->tv_sec) * BILLION +
+		(stop->tv_nsec - start->tv_nsec);
+}
+
+void context_benchmark(void) {
+	struct timespec start, stop;
+	void *stack;
+	long i;
+
+	if (!(stack = malloc(STACKSIZE)))
+		return;
+	if (context_init(&peer_ctx, stack, STACKSIZE, context_peer, NULL) < 0)
+		goto ERROR;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+		context_switch(&main_ctx, &peer_ctx);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	// two switches in every round
+	fprintf(stdout, "context_switch: %ld switches, avgtime %.1lf ns\n",
+		rounds * 2, elapsed(&start, &stop) / (rounds * 2));
+ ERROR:
+	free(stack);
+}
+
+void ucontext_benchmark(void) {
+	struct timespec start, stop;
+	void *stack;
+	long i;
+
+	if (!(stack = malloc(STACKSIZE)))
+		return;
+	getcontext(&peer_uc);
+	peer_uc.uc_stack.ss_sp = stack;
+	peer_uc.uc_stack.ss_size = STACKSIZE;
+	makecontext(&peer_uc, ucontext_peer, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+		swapcontext(&main_uc, &peer_uc);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	fprintf(stdout, "swapcontext: %ld switches, avgtime %.1lf ns\n",
+		rounds * 2, elapsed(&start, &stop) / (rounds * 2));
+	free(stack);
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1)
+		rounds = atol(argv[1]);
+	context_benchmark();
+	ucontext_benchmark();
+	return 0;
+}
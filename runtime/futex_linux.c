@@ -0,0 +1,28 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Sleep and wakeup on a 32 bits word, the idle threads park here.
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "runtime.h"
+
+
+// Sleep while *addr == val, at most ns nanoseconds if ns >= 0. may
+// return early and spuriously, the caller must check the condition.
+void futexsleep(unsigned int *addr, unsigned int val, long long ns) {
+	struct timespec ts, *tsp = NULL;
+
+	if (ns >= 0) {
+		ts.tv_sec = ns / 1000000000LL;
+		ts.tv_nsec = ns % 1000000000LL;
+		tsp = &ts;
+	}
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0);
+}
+
+// Wake up at most cnt threads sleeping on addr.
+void futexwakeup(unsigned int *addr, int cnt) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, cnt, NULL, NULL, 0);
+}
@@ -0,0 +1,138 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Task groups
+//
+// A group counts its members: the tasks spawned into it and, in turn,
+// the tasks they spawn. task_group_wait parks until they all stopped.
+// task_group_cancel raises a flag the members find at their next wait:
+// task_yield, task_sleep and the sys_* calls which would have to wait
+// fail with ECANCELED from then on. the members parked on a descriptor
+// are woken up at once, they registered a cancelwait for it.
+
+#include <stdlib.h>
+#include <errno.h>
+#include "task.h"
+#include "runtime.h"
+
+struct task_group {
+	// Lock must be the first field
+	struct spinlock Lock;
+	int count;		// members not stopped yet
+	int cancelled;
+	struct list_head waiters;	// in task_group_wait
+	struct list_head cancelq;	// members parked in an I/O wait
+};
+
+struct task_group *task_group_make(void) {
+	struct task_group *g;
+
+	if (!(g = malloc(sizeof(*g))))
+		return NULL;
+	spinlock_init(g);
+	g->count = 0;
+	g->cancelled = 0;
+	INIT_LIST_HEAD(&g->waiters);
+	INIT_LIST_HEAD(&g->cancelq);
+	return g;
+}
+
+void task_group_free(struct task_group *g) {
+	if (atomic_load(&g->count))
+		BUG_ON();
+	spinlock_destroy(g);
+	free(g);
+}
+
+void group_join(struct task_group *g) {
+	spin_lock(g);
+	g->count++;
+	spin_unlock(g);
+}
+
+// A member stopped, the last one wakes the waiters up.
+void group_leave(struct task_group *g) {
+	struct list_head q;
+	struct waiter *w;
+
+	INIT_LIST_HEAD(&q);
+	spin_lock(g);
+	if (--g->count < 0)
+		BUG_ON();
+	if (!g->count)
+		list_splice(&g->waiters, &q);
+	spin_unlock(g);
+	// g may be freed from here on
+	while (!list_empty(&q)) {
+		w = list_first(&q, struct waiter, link);
+		list_del_init(&w->link);
+		task_ready(w->task);
+	}
+}
+
+static int group_unlock(struct task *t, void *arg) {
+	(void)t;
+	spin_unlock(arg);
+	return 1;
+}
+
+int task_group_wait(struct task_group *g) {
+	struct waiter w;
+
+	spin_lock(g);
+	if (!g->count) {
+		spin_unlock(g);
+		return 0;
+	}
+	WAITER_INIT(&w);
+	list_add_tail(&w.link, &g->waiters);
+	task_park(group_unlock, g);
+	return 0;
+}
+
+// The callbacks run under the lock of g, a member can't return from
+// its wait before its cancelwait is off the queue.
+void task_group_cancel(struct task_group *g) {
+	struct cancelwait *cw;
+
+	spin_lock(g);
+	atomic_store(&g->cancelled, 1);
+	while (!list_empty(&g->cancelq)) {
+		cw = list_first(&g->cancelq, struct cancelwait, link);
+		list_del_init(&cw->link);
+		cw->cancel(cw->arg);
+	}
+	spin_unlock(g);
+}
+
+int task_cancelled(void) {
+	struct task *t = task_current();
+
+	return t && t->group && atomic_load(&t->group->cancelled);
+}
+
+int group_cancelwait_add(struct task *t, struct cancelwait *cw) {
+	struct task_group *g = t->group;
+
+	INIT_LIST_HEAD(&cw->link);
+	if (!g)
+		return 0;
+	spin_lock(g);
+	if (g->cancelled) {
+		spin_unlock(g);
+		errno = ECANCELED;
+		return -1;
+	}
+	list_add_tail(&cw->link, &g->cancelq);
+	spin_unlock(g);
+	return 0;
+}
+
+void group_cancelwait_del(struct task *t, struct cancelwait *cw) {
+	struct task_group *g = t->group;
+
+	if (!g)
+		return;
+	spin_lock(g);
+	list_del_init(&cw->link);
+	spin_unlock(g);
+}
@@ -152,6 +152,15 @@ static inline void list_splice(struct list_head *head1, struct list_head *head2)
 	}
 }
 
+// Join two lists and then reinitialize the first head
+// all entries in head1 will be moved into head2's tail
+static inline void list_splice_tail(struct list_head *head1, struct list_head *head2) {
+	if (!list_empty(head1)) {
+		__list_splice(head1, head2->prev);
+		INIT_LIST_HEAD(head1);
+	}
+}
+
 
 
 // Get the struct for this entry
@@ -1,6 +1,9 @@
 /* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
 
 #include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #include "malloc.h"
 
 
@@ -25,3 +28,232 @@ void *sys_alloc2(void *ptr, int size) {
 void sys_free(void *ptr, int size) {
 	munmap(ptr, size);
 }
+
+
+// Task stacks. the stacks of a size are carved out of chunks of about
+// STACK_CHUNK_BYTES reserved with MAP_NORESERVE, the kernel commits the
+// pages only when they are touched. a guard page below each stack
+// faults on an overflow instead of corrupting the stack below: a guard
+// region of MADV_GUARD_INSTALL costs no mapping, the older kernels
+// split the chunk with mprotect, two mappings a stack, and once
+// vm.max_map_count runs out the new stacks go unguarded. the freed
+// stacks go back to their pool, the chunks are never unmapped. the
+// sizes past STACK_POOLS get a mapping each.
+//
+// A freed stack keeps its pages, the next spawn takes it warm. the
+// stacks left in the pool between two rounds of the scavenger are
+// idle, their pages are given back then, so a burst of spawns doesn't
+// pay a madvise and the faults for every stack it cycles.
+#define STACK_CHUNK_BYTES (64L << 20)
+#define STACK_POOLS 16
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+#define GUARD_REGION 0
+#define GUARD_MPROTECT 1
+#define GUARD_NONE 2
+
+struct stackpool {
+	int size;		// 0 if unused
+	char *next, *end;	// not carved yet of the last chunk
+	void **dirty;		// freed with their pages, the warmest last
+	void **clean;		// the pages given back
+	int ndirty, nclean;
+	int lowdirty;		// the fewest dirty since the last scavenge
+	int ncarved, cap;	// both lists have room for all the carved
+};
+
+static struct {
+	// Lock must be the first field
+	struct spinlock Lock;
+	int guard;		// GUARD_*
+	struct stackpool pools[STACK_POOLS];
+} stacks;
+
+static long stack_pagesize(void) {
+	static long pagesize;
+
+	if (!pagesize)
+		pagesize = sysconf(_SC_PAGESIZE);
+	return pagesize;
+}
+
+void sys_stack_init(void) {
+	spinlock_init(&stacks);
+	stacks.guard = GUARD_REGION;
+}
+
+int sys_stack_size(int size) {
+	long pagesize = stack_pagesize();
+
+	return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
+static struct stackpool *stackpool_find(int size, int create) {
+	struct stackpool *p;
+
+	for (p = stacks.pools; p < stacks.pools + STACK_POOLS; p++) {
+		if (p->size == size)
+			return p;
+		if (!p->size) {
+			if (!create)
+				return NULL;
+			p->size = size;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+// Guard the page at g, under the lock.
+static void stack_guard(char *g) {
+	long pagesize = stack_pagesize();
+
+	switch (stacks.guard) {
+	case GUARD_REGION:
+		if (madvise(g, pagesize, MADV_GUARD_INSTALL) == 0)
+			return;
+		stacks.guard = GUARD_MPROTECT;
+		// fall through
+	case GUARD_MPROTECT:
+		if (mprotect(g, pagesize, PROT_NONE) == 0)
+			return;
+		stacks.guard = GUARD_NONE;
+	}
+}
+
+// Carve a stack out of p, with a new chunk if the last one is used up.
+static void *stackpool_carve(struct stackpool *p) {
+	long slot = p->size + stack_pagesize(), n;
+	void **list;
+	char *ptr;
+
+	if (p->ncarved == p->cap) {
+		n = p->cap ? p->cap * 2 : 64;
+		if (!(list = realloc(p->dirty, sizeof(*list) * n)))
+			return NULL;
+		p->dirty = list;
+		if (!(list = realloc(p->clean, sizeof(*list) * n)))
+			return NULL;
+		p->clean = list;
+		p->cap = n;
+	}
+	if (p->next == p->end) {
+		n = STACK_CHUNK_BYTES / slot > 0 ? STACK_CHUNK_BYTES / slot : 1;
+		ptr = mmap(NULL, n * slot, PROT_READ|PROT_WRITE,
+			   MAP_ANON|MAP_PRIVATE|MAP_NORESERVE|MAP_STACK, -1, 0);
+		if (ptr == MAP_FAILED)
+			return NULL;
+		p->next = ptr;
+		p->end = ptr + n * slot;
+	}
+	ptr = p->next;
+	p->next += slot;
+	p->ncarved++;
+	stack_guard(ptr);
+	return ptr + stack_pagesize();
+}
+
+// A stack of its own for the sizes without a pool.
+static void *stack_map(int size) {
+	long guard = stack_pagesize();
+	char *ptr;
+
+	ptr = mmap(NULL, size + guard, PROT_READ|PROT_WRITE,
+		   MAP_ANON|MAP_PRIVATE|MAP_NORESERVE|MAP_STACK, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	// out of mappings it goes unguarded, like the pooled stacks
+	mprotect(ptr, guard, PROT_NONE);
+	return ptr + guard;
+}
+
+// Returns the lowest usable address of a stack of size bytes, size must
+// be rounded by sys_stack_size. NULL if the memory or the mappings run
+// out.
+void *sys_stack_alloc(int size) {
+	struct stackpool *p;
+	void *ptr;
+
+	spin_lock(&stacks);
+	if (!(p = stackpool_find(size, 1))) {
+		spin_unlock(&stacks);
+		return stack_map(size);
+	}
+	if (p->ndirty) {
+		ptr = p->dirty[--p->ndirty];
+		if (p->ndirty < p->lowdirty)
+			p->lowdirty = p->ndirty;
+	} else if (p->nclean)
+		ptr = p->clean[--p->nclean];
+	else
+		ptr = stackpool_carve(p);
+	spin_unlock(&stacks);
+	return ptr;
+}
+
+// A pooled stack goes back with its pages, the scavenger gives them back
+// if it's not taken soon.
+void sys_stack_free(void *stack, int size) {
+	struct stackpool *p;
+
+	spin_lock(&stacks);
+	if ((p = stackpool_find(size, 0))) {
+		p->dirty[p->ndirty++] = stack;
+		spin_unlock(&stacks);
+		return;
+	}
+	spin_unlock(&stacks);
+	munmap((char *)stack - stack_pagesize(), size + stack_pagesize());
+}
+
+// Give back the pages of the stacks that stayed in their pool since the
+// last call, sysmon calls it about once a second. the spawns take the
+// warmest stacks off the top, the idle ones are at the bottom.
+void sys_stack_scavenge(void) {
+	struct stackpool *p;
+	void **idle;
+	int i, n;
+
+	for (p = stacks.pools; p < stacks.pools + STACK_POOLS; p++) {
+		spin_lock(&stacks);
+		if (!p->size) {
+			spin_unlock(&stacks);
+			return;
+		}
+		idle = NULL;
+		if ((n = p->lowdirty) > 0 && (idle = malloc(sizeof(*idle) * n))) {
+			memcpy(idle, p->dirty, sizeof(*idle) * n);
+			p->ndirty -= n;
+			memmove(p->dirty, p->dirty + n, sizeof(*idle) * p->ndirty);
+		}
+		p->lowdirty = p->ndirty;
+		spin_unlock(&stacks);
+		if (!idle)
+			continue;
+		for (i = 0; i < n; i++)
+			madvise(idle[i], p->size, MADV_DONTNEED);
+		spin_lock(&stacks);
+		memcpy(p->clean + p->nclean, idle, sizeof(*idle) * n);
+		p->nclean += n;
+		spin_unlock(&stacks);
+		free(idle);
+	}
+}
+
+// Whether addr falls on the guard page of the stack.
+int sys_stack_guarded(void *stack, void *addr) {
+	return (char *)addr < (char *)stack &&
+		(char *)addr >= (char *)stack - stack_pagesize();
+}
+
+// Give the pages of a stack below its top keep bytes back to the kernel,
+// they read as zeros on the next touch. the pages never touched cost
+// madvise nothing, the stack can't tell how deep it went anyway.
+void sys_stack_trim(void *stack, int size, int keep) {
+	keep = sys_stack_size(keep);
+	if (keep < size)
+		madvise(stack, size - keep, MADV_DONTNEED);
+}
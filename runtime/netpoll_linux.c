@@ -0,0 +1,424 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// epoll based network poller
+//
+// A task gets EAGAIN from a non-blocking descriptor parks on the poll
+// descriptor of the fd, the scheduler polls epoll when it's idle and
+// between batches, and makes the waiters runnable again when the fd
+// becomes ready. the fd is registered edge triggered the first time a
+// task waits for it, for reading and writing both, so no more epoll_ctl
+// on the fast path. a descriptor that has been waited on must be closed
+// by sys_close, which drops the registration and wakes up the waiters.
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "task.h"
+#include "runtime.h"
+
+struct polldesc {
+	// Lock must be the first field
+	struct spinlock Lock;
+	int fd;
+	int registered;
+	int closing;
+	int rready, wready;
+	struct list_head rq, wq;	// waiters
+	int kind;			// FD_KIND_*, cached
+	void (*ready)(void *arg);	// watched by netpoll_watch
+	void *arg;
+};
+
+#define FD_KIND_UNKNOWN 0
+#define FD_KIND_OTHER 1
+#define FD_KIND_FILE 2
+
+// two level table of poll descriptors, indexed by fd. the chunks are
+// never freed, so a polldesc pointer stays valid.
+#define PD_CHUNK_SHIFT 10
+#define PD_CHUNK_SIZE (1 << PD_CHUNK_SHIFT)
+#define PD_CHUNKS 1024
+
+static struct polldesc *pdtab[PD_CHUNKS];
+
+static int epfd = -1;
+static int breakfd = -1;
+static int breakpending;
+static int nwaiters;
+
+static struct polldesc *pd_get(int fd) {
+	struct polldesc *chunk;
+	int i, idx = fd >> PD_CHUNK_SHIFT;
+
+	if (fd < 0 || idx >= PD_CHUNKS)
+		return NULL;
+	if ((chunk = atomic_load(&pdtab[idx])))
+		return &chunk[fd & (PD_CHUNK_SIZE - 1)];
+	if (!(chunk = malloc(sizeof(*chunk) * PD_CHUNK_SIZE)))
+		return NULL;
+	memset(chunk, 0, sizeof(*chunk) * PD_CHUNK_SIZE);
+	for (i = 0; i < PD_CHUNK_SIZE; i++) {
+		spinlock_init(&chunk[i]);
+		chunk[i].fd = (idx << PD_CHUNK_SHIFT) + i;
+		INIT_LIST_HEAD(&chunk[i].rq);
+		INIT_LIST_HEAD(&chunk[i].wq);
+	}
+	if (!atomic_cas(&pdtab[idx], NULL, chunk)) {
+		free(chunk);
+		chunk = atomic_load(&pdtab[idx]);
+	}
+	return &chunk[fd & (PD_CHUNK_SIZE - 1)];
+}
+
+int netpoll_init(void) {
+	struct epoll_event ev;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		fprintf(stderr, "epoll_create1 failed\n");
+		return -1;
+	}
+	if ((breakfd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)) < 0) {
+		fprintf(stderr, "eventfd failed\n");
+		goto ERROR;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, breakfd, &ev) < 0) {
+		fprintf(stderr, "epoll_ctl breakfd failed\n");
+		close(breakfd);
+		goto ERROR;
+	}
+	return 0;
+ ERROR:
+	close(epfd);
+	epfd = -1;
+	return -1;
+}
+
+// Whether any task is parked on the poller.
+int netpoll_inuse(void) {
+	return atomic_load(&nwaiters) > 0;
+}
+
+// Account the tasks waiting for a watched descriptor, see netpoll_watch.
+void netpoll_hold(int delta) {
+	atomic_add(&nwaiters, delta);
+}
+
+// Call ready(arg) from netpoll whenever fd is readable, level
+// triggered. the waiters of ready must be accounted by netpoll_hold.
+int netpoll_watch(int fd, void (*ready)(void *arg), void *arg) {
+	struct epoll_event ev;
+	struct polldesc *pd;
+
+	if (epfd < 0 || !(pd = pd_get(fd)))
+		return -1;
+	pd->ready = ready;
+	pd->arg = arg;
+	ev.events = EPOLLIN;
+	ev.data.ptr = pd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		pd->ready = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+// Whether fd is a regular file or a block device, which O_NONBLOCK and
+// epoll have no effect on.
+int netpoll_isfile(int fd) {
+	struct polldesc *pd;
+	struct stat st;
+	int kind;
+
+	if (!(pd = pd_get(fd)))
+		return 0;
+	if ((kind = atomic_load(&pd->kind)) == FD_KIND_UNKNOWN) {
+		if (fstat(fd, &st) < 0)
+			return 0;
+		kind = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) ?
+			FD_KIND_FILE : FD_KIND_OTHER;
+		atomic_store(&pd->kind, kind);
+	}
+	return kind == FD_KIND_FILE;
+}
+
+// Interrupt a thread blocked in netpoll.
+void netpoll_break(void) {
+	unsigned long long one = 1;
+
+	if (!atomic_cas(&breakpending, 0, 1))
+		return;
+	if (write(breakfd, &one, sizeof(one)) < 0)
+		atomic_store(&breakpending, 0);
+}
+
+static int pd_register(struct polldesc *pd) {
+	struct epoll_event ev;
+
+	if (atomic_load(&pd->registered))
+		return 0;
+	ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+	ev.data.ptr = pd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, pd->fd, &ev) < 0 && errno != EEXIST)
+		return -1;
+	atomic_store(&pd->registered, 1);
+	return 0;
+}
+
+// Wake up all the waiters on q, they retry their syscall. returns the
+// number of them, the stale task_select waiters don't count.
+static int pd_wakeall(struct list_head *q, int ret) {
+	struct waiter *w;
+	int n = 0;
+
+	while (!list_empty(q)) {
+		w = list_first(q, struct waiter, link);
+		list_del_init(&w->link);
+		switch (waiter_claim(w)) {
+		case 1:
+			w->ret = ret;
+			task_ready(w->task);
+			n++;
+			break;
+		case 2:
+			w->ret = ret;
+			n++;
+			break;
+		}
+	}
+	return n;
+}
+
+static int pd_unlock(struct task *t, void *arg) {
+	(void)t;
+	spin_unlock(arg);
+	return 1;
+}
+
+struct pollwait {
+	struct waiter w;
+	struct polldesc *pd;
+};
+
+static void pd_wake(struct pollwait *pw, int err) {
+	spin_lock(pw->pd);
+	if (!list_empty(&pw->w.link)) {
+		list_del_init(&pw->w.link);
+		pw->w.ret = err;
+		task_ready(pw->w.task);
+	}
+	spin_unlock(pw->pd);
+}
+
+static void pd_timeout(struct timer *tm, void *arg) {
+	(void)tm;
+	pd_wake(arg, ETIMEDOUT);
+}
+
+static void pd_cancel(void *arg) {
+	pd_wake(arg, ECANCELED);
+}
+
+// Park the current task until fd is ready for reading (mode 'r') or
+// writing ('w'), or the nanotime deadline passed if it's not -1. the
+// deadline of the task, if earlier, applies as well. a fd that epoll
+// can't watch is retried after a yield. returns -1 with errno EBADF if
+// fd is closed by sys_close meanwhile, ETIMEDOUT, ECANCELED if the
+// group of the task is cancelled, or ENOMEM if the deadline can't be
+// armed.
+int netpoll_wait(int fd, int mode, long long deadline) {
+	struct task *t = task_current();
+	struct polldesc *pd;
+	struct pollwait pw;
+	struct cancelwait cw;
+	struct timer tm;
+	int *ready, err;
+
+	if (t && t->deadline >= 0 && (deadline < 0 || t->deadline < deadline))
+		deadline = t->deadline;
+	if (deadline >= 0 && deadline <= nanotime()) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if (epfd < 0 || !(pd = pd_get(fd)) || pd_register(pd) < 0)
+		return yield();
+	WAITER_INIT(&pw.w);
+	INIT_LIST_HEAD(&pw.w.link);
+	pw.pd = pd;
+	// queued first, a cancel coming before pw is on pd is seen below
+	cw.cancel = pd_cancel;
+	cw.arg = &pw;
+	if (group_cancelwait_add(pw.w.task, &cw) < 0)
+		return -1;
+	spin_lock(pd);
+	if (pd->closing || task_cancelled()) {
+		err = pd->closing ? EBADF : ECANCELED;
+		spin_unlock(pd);
+		group_cancelwait_del(pw.w.task, &cw);
+		errno = err;
+		return -1;
+	}
+	ready = mode == 'r' ? &pd->rready : &pd->wready;
+	if (*ready) {
+		*ready = 0;
+		spin_unlock(pd);
+		group_cancelwait_del(pw.w.task, &cw);
+		return 0;
+	}
+	list_add_tail(&pw.w.link, mode == 'r' ? &pd->rq : &pd->wq);
+	if (deadline >= 0) {
+		tm.when = deadline;
+		tm.f = pd_timeout;
+		tm.arg = &pw;
+		if (timer_add(&tm) < 0) {
+			// nothing would end the wait
+			err = errno;
+			list_del_init(&pw.w.link);
+			spin_unlock(pd);
+			group_cancelwait_del(pw.w.task, &cw);
+			errno = err;
+			return -1;
+		}
+	}
+	atomic_add(&nwaiters, 1);
+	task_park(pd_unlock, pd);
+	atomic_sub(&nwaiters, 1);
+	if (deadline >= 0)
+		timer_del(&tm);
+	group_cancelwait_del(pw.w.task, &cw);
+	if (pw.w.ret) {
+		errno = pw.w.ret;
+		return -1;
+	}
+	return 0;
+}
+
+// Queue w, a task_select waiter, for fd becoming ready for mode. returns
+// 1 if it needn't wait: fd is ready already and w claimed its select,
+// or the select has been claimed meanwhile. returns -1 with errno if
+// fd can't be waited on, 0 once w is queued.
+int netpoll_arm(int fd, int mode, struct waiter *w) {
+	struct polldesc *pd;
+	struct pollfd pfd;
+	int *ready;
+
+	if (epfd < 0 || !(pd = pd_get(fd)) || pd_register(pd) < 0)
+		return -1;
+	spin_lock(pd);
+	if (pd->closing) {
+		spin_unlock(pd);
+		errno = EBADF;
+		return -1;
+	}
+	// the flag may be left from an edge nobody consumed, the waiter
+	// of a select only takes the real readiness. a new edge finds the
+	// waiter queued, as it needs the lock.
+	ready = mode == 'r' ? &pd->rready : &pd->wready;
+	if (*ready) {
+		pfd.fd = fd;
+		pfd.events = mode == 'r' ? POLLIN : POLLOUT;
+		if (poll(&pfd, 1, 0) > 0) {
+			if (waiter_claim(w))
+				*ready = 0;
+			spin_unlock(pd);
+			return 1;
+		}
+		*ready = 0;
+	}
+	list_add_tail(&w->link, mode == 'r' ? &pd->rq : &pd->wq);
+	atomic_add(&nwaiters, 1);
+	spin_unlock(pd);
+	return 0;
+}
+
+// Take an armed w off fd, if it's not been woken.
+void netpoll_disarm(int fd, struct waiter *w) {
+	struct polldesc *pd = pd_get(fd);
+
+	spin_lock(pd);
+	if (!list_empty(&w->link))
+		list_del_init(&w->link);
+	spin_unlock(pd);
+	atomic_sub(&nwaiters, 1);
+}
+
+// Forget the registration of fd before it's closed, and fail the
+// waiters with EBADF.
+void netpoll_close(int fd) {
+	struct polldesc *pd;
+	int idx = fd >> PD_CHUNK_SHIFT;
+
+	if (fd < 0 || idx >= PD_CHUNKS || !atomic_load(&pdtab[idx]))
+		return;
+	pd = pd_get(fd);
+	spin_lock(pd);
+	pd->closing = 1;
+	pd_wakeall(&pd->rq, EBADF);
+	pd_wakeall(&pd->wq, EBADF);
+	if (atomic_load(&pd->registered))
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	pd->registered = 0;
+	pd->kind = FD_KIND_UNKNOWN;
+	pd->rready = pd->wready = 0;
+	pd->closing = 0;
+	spin_unlock(pd);
+}
+
+#define NETPOLL_EVENTS 128
+
+// Poll the ready descriptors, waiting at most ns nanoseconds (-1 for
+// ever), and make their waiters runnable. returns nonzero if any task
+// may be made runnable.
+int netpoll(long long ns) {
+	struct epoll_event events[NETPOLL_EVENTS];
+	struct polldesc *pd;
+	unsigned long long val;
+	int i, n, cnt = 0, timeout;
+	ssize_t r;
+
+	if (epfd < 0)
+		return 0;
+	if (ns < 0)
+		timeout = -1;
+	else if (ns == 0)
+		timeout = 0;
+	else if ((timeout = (ns + 999999) / 1000000) <= 0)
+		timeout = 1;
+	n = epoll_wait(epfd, events, NETPOLL_EVENTS, timeout);
+	for (i = 0; i < n; i++) {
+		if (!(pd = events[i].data.ptr)) {
+			// drained, a failure leaves it readable at worst
+			r = read(breakfd, &val, sizeof(val));
+			(void)r;
+			atomic_store(&breakpending, 0);
+			continue;
+		}
+		if (pd->ready) {
+			pd->ready(pd->arg);
+			cnt++;
+			continue;
+		}
+		spin_lock(pd);
+		if (events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) {
+			if (pd_wakeall(&pd->rq, 0))
+				cnt++;
+			else
+				pd->rready = 1;
+		}
+		if (events[i].events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) {
+			if (pd_wakeall(&pd->wq, 0))
+				cnt++;
+			else
+				pd->wready = 1;
+		}
+		spin_unlock(pd);
+	}
+	return cnt;
+}
@@ -0,0 +1,142 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Fork-join loops
+//
+// A task splits its range in halves until it's down to the grain. it
+// keeps the left half and spawns the right one on the local run queue,
+// where the idle threads steal it, the biggest halves are the oldest in
+// the queue and go first. it then runs its chunk and joins the halves
+// in the order of the ranges, folding their accumulators into its own.
+// the join parks the task, so the thread runs the halves not stolen.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "task.h"
+#include "runtime.h"
+#include "parallel.h"
+
+// halvings of a task, more than a long range can take
+#define PARALLEL_DEPTH 64
+
+// auto grain, chunks per thread
+#define PARALLEL_CHUNKS 8
+
+struct prange {
+	long begin, end;
+	void *result;		// accumulator, reduce only
+	struct pctx *ctx;
+};
+
+struct pctx {
+	long grain;
+	void (*forbody)(long begin, long end, void *arg);
+	void (*body)(long begin, long end, void *result, void *arg);
+	void (*join)(void *result, const void *other, void *arg);
+	void *arg;
+	void *identity;
+	int elemsize;
+};
+
+static void *prange_main(void *arg);
+
+static void prange_run(struct prange *r) {
+	struct pctx *ctx = r->ctx;
+	struct prange half[PARALLEL_DEPTH];
+	task_t *t[PARALLEL_DEPTH];
+	char *acc = NULL;
+	long mid, begin = r->begin, end = r->end;
+	int i, n = 0;
+
+	while (end - begin > ctx->grain && n < PARALLEL_DEPTH) {
+		if (ctx->elemsize && !acc && !(acc = malloc(PARALLEL_DEPTH * ctx->elemsize)))
+			break;
+		mid = begin + (end - begin) / 2;
+		half[n].begin = mid;
+		half[n].end = end;
+		half[n].ctx = ctx;
+		half[n].result = NULL;
+		if (acc) {
+			half[n].result = acc + n * ctx->elemsize;
+			memcpy(half[n].result, ctx->identity, ctx->elemsize);
+		}
+		// out of memory, the rest is ours
+		if (!(t[n] = task_spawn(prange_main, &half[n], 0)))
+			break;
+		n++;
+		end = mid;
+	}
+	if (ctx->forbody)
+		ctx->forbody(begin, end, ctx->arg);
+	else
+		ctx->body(begin, end, r->result, ctx->arg);
+	for (i = n - 1; i >= 0; i--) {
+		if (task_join(t[i], NULL) < 0)
+			BUG_ON();
+		if (ctx->join)
+			ctx->join(r->result, half[i].result, ctx->arg);
+	}
+	free(acc);
+}
+
+static void *prange_main(void *arg) {
+	prange_run(arg);
+	return NULL;
+}
+
+static int parallel_run(struct pctx *ctx, long begin, long end, void *result) {
+	struct prange r = {begin, end, result, ctx};
+	int nprocs;
+
+	if (begin >= end)
+		return 0;
+	if (ctx->grain <= 0) {
+		nprocs = task_setmaxprocs(0);
+		ctx->grain = (end - begin) / (nprocs * PARALLEL_CHUNKS);
+	}
+	if (ctx->grain <= 0)
+		ctx->grain = 1;
+	// nothing to join on outside of the tasks
+	if (!task_current())
+		ctx->grain = end - begin;
+	prange_run(&r);
+	return 0;
+}
+
+int task_parallel_for(long begin, long end, long grain,
+		      void (*body)(long begin, long end, void *arg), void *arg) {
+	struct pctx ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.grain = grain;
+	ctx.forbody = body;
+	ctx.arg = arg;
+	return parallel_run(&ctx, begin, end, NULL);
+}
+
+int task_parallel_reduce(long begin, long end, long grain, void *result, int elemsize,
+			 void (*body)(long begin, long end, void *result, void *arg),
+			 void (*join)(void *result, const void *other, void *arg),
+			 void *arg) {
+	struct pctx ctx;
+	int ret;
+
+	if (elemsize <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.grain = grain;
+	ctx.body = body;
+	ctx.join = join;
+	ctx.arg = arg;
+	ctx.elemsize = elemsize;
+	if (!(ctx.identity = malloc(elemsize))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(ctx.identity, result, elemsize);
+	ret = parallel_run(&ctx, begin, end, result);
+	free(ctx.identity);
+	return ret;
+}
@@ -0,0 +1,25 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+// Fork-join loops over the tasks, see parallel.c. the range [begin,
+// end) is split in halves down to grain, the halves are spawned on the
+// local run queue for the idle threads to steal and joined by parking.
+// a grain <= 0 picks one from the range and the number of threads.
+
+// Call body(b, e, arg) on chunks [b, e) covering [begin, end).
+// Both return 0, or -1 with errno set if they can't start.
+int task_parallel_for(long begin, long end, long grain,
+		      void (*body)(long begin, long end, void *arg), void *arg);
+
+// Reduce [begin, end) into *result of elemsize bytes, which holds the
+// identity on entry. body folds the chunk [b, e) into its accumulator,
+// join folds the accumulator of the next chunk into the one before, it
+// must be associative.
+int task_parallel_reduce(long begin, long end, long grain, void *result, int elemsize,
+			 void (*body)(long begin, long end, void *result, void *arg),
+			 void (*join)(void *result, const void *other, void *arg),
+			 void *arg);
+
+#endif /* _PARALLEL_H_ */
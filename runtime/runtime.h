@@ -3,18 +3,175 @@
 #ifndef _RUNTIME_H_
 #define _RUNTIME_H_
 
-// spinlock
 #include <pthread.h>
+#include <sys/uio.h>
+#include "list.h"
+#include "spinlock.h"
 
-struct spinlock {
-	pthread_spinlock_t rawLock;
+
+// parking, see task.c
+struct task;
+
+// A task_select waiting on several things at once, the first of them
+// claims it and the others leave it alone.
+struct selectwait {
+	int state;
+	int fired;		// index of the case which claimed it
+};
+
+#define SEL_REGISTERING 0	// still queueing its waiters
+#define SEL_PARKED 1
+#define SEL_FIRED 2		// claimed after it parked
+#define SEL_FIRED_EARLY 3	// claimed before it parked
+
+// A task waiting for something, linked on the wait queue of the thing
+// it's waiting for. lives on the stack of the waiting task.
+struct waiter {
+	struct task *task;
+	struct list_head link;
+	int ret;		// errno for the waiter, 0 if woken normally
+	struct selectwait *sel;	// NULL unless in task_select
+	int index;		// case index in task_select
+};
+
+#define WAITER_INIT(w) do { \
+	(w)->task = task_current(); \
+	(w)->ret = 0; \
+	(w)->sel = NULL; \
+} while (0)
+
+extern struct task *task_current(void);
+// Park the current task. commit(t, arg) runs on the scheduler stack
+// once the context of t is saved, it typically releases the lock which
+// protects the wait queue t is linked on. t runs again at once if
+// commit returns 0.
+extern void task_park(int (*commit)(struct task *t, void *arg), void *arg);
+// Make a parked task runnable.
+extern void task_ready(struct task *t);
+// Claim w off a wait queue before waking it up, under the lock of the
+// queue. returns 0 if w belongs to a task_select somebody else woke,
+// 1 if w->task must be made ready once the lock is released, 2 if the
+// task isn't parked yet and will find it out by itself.
+extern int waiter_claim(struct waiter *w);
+
+
+// timers, see timer.c
+struct timers {
+	// Lock must be the first field
+	struct spinlock Lock;
+	struct timer **heap;
+	int n, cap;
+	long long next;		// deadline of heap[0], -1 if empty
+};
+
+struct timer {
+	long long when;		// nanotime deadline
+	int index;		// in the heap
+	int status;
+	struct timers *ts;	// the heap it's on
+	void (*f)(struct timer *tm, void *arg);
+	void *arg;
+};
+
+extern long long nanotime(void);
+extern void timers_init(struct timers *ts);
+extern void timers_destroy(struct timers *ts);
+extern int timer_add(struct timer *tm);
+// A timer must be deleted before its memory is reused, even if it fired.
+extern int timer_del(struct timer *tm);
+extern long long timers_next(struct timers *ts);
+extern int timers_run(struct timers *ts, long long now);
+// The heap of the current thread, NULL outside of the scheduler.
+extern struct timers *timers_local(void);
+// Make sure the thread polling the network looks at the timers again.
+extern void timer_wakeup(void);
+
+
+// network poller, see netpoll_linux.c
+extern int netpoll_init(void);
+extern int netpoll_inuse(void);
+extern void netpoll_break(void);
+extern int netpoll_wait(int fd, int mode, long long deadline);
+extern int netpoll_arm(int fd, int mode, struct waiter *w);
+extern void netpoll_disarm(int fd, struct waiter *w);
+extern void netpoll_close(int fd);
+extern int netpoll(long long ns);
+extern void netpoll_hold(int delta);
+extern int netpoll_watch(int fd, void (*ready)(void *arg), void *arg);
+extern int netpoll_isfile(int fd);
+
+
+// io_uring, see uring_linux.c
+extern int uring_rw(int op, int fd, const struct iovec *iov, int iovcnt,
+		    long long offset, long long *res);
+
+
+// threads, see thread_linux.c
+extern int sys_gettid(void);
+extern int sys_thread_blocked(int tid);
+extern int sys_cpu_pick(int id, int *node);
+extern int sys_thread_bind(int cpu);
+extern void sys_thread_unbind(void);
+
+
+// blocking pool, see blocking.c
+extern void blocking_shutdown(void);
+
+
+// task groups, see group.c
+struct task_group;
+
+// A member of a group parked somewhere task_group_cancel must wake it
+// up from. cancel(arg) runs under the lock of the group, it must not
+// take it again.
+struct cancelwait {
+	struct list_head link;
+	void (*cancel)(void *arg);
+	void *arg;
 };
 
-extern void spinlock_init(void *lock);
-extern void spinlock_destroy(void *lock);
-extern void spin_lock(void *lock);
-extern void spin_unlock(void *lock);
+extern void group_join(struct task_group *g);
+extern void group_leave(struct task_group *g);
+// Queue cw on the group of t, if any. returns -1 with errno ECANCELED
+// if it's cancelled already.
+extern int group_cancelwait_add(struct task *t, struct cancelwait *cw);
+extern void group_cancelwait_del(struct task *t, struct cancelwait *cw);
+
+
+// futex, see futex_linux.c
+extern void futexsleep(unsigned int *addr, unsigned int val, long long ns);
+extern void futexwakeup(unsigned int *addr, int cnt);
+
 
+// task stacks, see mem_linux.c
+extern void sys_stack_init(void);
+extern int sys_stack_size(int size);
+extern void *sys_stack_alloc(int size);
+extern void sys_stack_free(void *stack, int size);
+extern void sys_stack_scavenge(void);
+extern int sys_stack_guarded(void *stack, void *addr);
+extern void sys_stack_trim(void *stack, int size, int keep);
+
+
+// atomic, thin wrappers of the gcc __atomic builtins. load/store
+// are acquire/release, read-modify-write operations are seq_cst.
+#define atomic_load(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_store(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define atomic_xchg(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+#define atomic_add(ptr, val) __atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define atomic_sub(ptr, val) __atomic_sub_fetch(ptr, val, __ATOMIC_SEQ_CST)
+#define atomic_cas(ptr, old, new) ({ \
+	__typeof__(*(ptr)) __old = (old); \
+	__atomic_compare_exchange_n(ptr, &__old, new, 0, \
+				    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED); })
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
 
 
 #endif
@@ -0,0 +1,19 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+// spinlock, see spinlock.c. the functions take a pointer to any struct
+// which has a struct spinlock as its first field.
+#include <pthread.h>
+
+struct spinlock {
+	pthread_spinlock_t rawLock;
+};
+
+extern void spinlock_init(void *lock);
+extern void spinlock_destroy(void *lock);
+extern void spin_lock(void *lock);
+extern void spin_unlock(void *lock);
+
+#endif /* _SPINLOCK_H_ */
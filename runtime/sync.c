@@ -0,0 +1,288 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Sleeping locks
+//
+// The mutex is taken by a cas on its state when it's free, a task
+// finding it locked queues itself under the spinlock and parks. the
+// unlocker wakes the first waiter, which competes with the newcomers
+// for the mutex and goes back to the front of the queue if it loses.
+// once the first waiter has waited longer than MUTEX_STARVE_NS, the
+// unlocker hands the mutex over to it directly instead, so under heavy
+// contention the mutex passes in FIFO order and nobody starves. the
+// semaphore always hands its units over to the waiters in FIFO order.
+
+#include <stdlib.h>
+#include <errno.h>
+#include "task.h"
+#include "runtime.h"
+#include "sync.h"
+
+#define MUTEX_LOCKED 1
+#define MUTEX_WAITERS 2		// changed under the spinlock only
+
+#define MUTEX_STARVE_NS 1000000LL
+
+struct mutexwaiter {
+	struct waiter w;
+	long long since;	// nanotime it first queued
+	int handoff;		// woken as the owner
+};
+
+static int sync_unlock(struct task *t, void *arg) {
+	(void)t;
+	spin_unlock(arg);
+	return 1;
+}
+
+void task_mutex_init(struct task_mutex *m) {
+	spinlock_init(m);
+	m->state = 0;
+	INIT_LIST_HEAD(&m->waiters);
+}
+
+void task_mutex_destroy(struct task_mutex *m) {
+	spinlock_destroy(m);
+}
+
+int task_mutex_trylock(struct task_mutex *m) {
+	int state = atomic_load(&m->state);
+
+	while (!(state & MUTEX_LOCKED)) {
+		if (atomic_cas(&m->state, state, state | MUTEX_LOCKED))
+			return 0;
+		state = atomic_load(&m->state);
+	}
+	errno = EBUSY;
+	return -1;
+}
+
+void task_mutex_lock(struct task_mutex *m) {
+	struct mutexwaiter mw;
+	int state, requeue = 0;
+
+	if (atomic_cas(&m->state, 0, MUTEX_LOCKED))
+		return;
+	mw.since = nanotime();
+	for (;;) {
+		spin_lock(m);
+		for (;;) {
+			state = atomic_load(&m->state);
+			if (!(state & MUTEX_LOCKED)) {
+				if (atomic_cas(&m->state, state, state | MUTEX_LOCKED)) {
+					spin_unlock(m);
+					return;
+				}
+				continue;
+			}
+			// the unlocker takes the slow path from now on
+			if ((state & MUTEX_WAITERS) ||
+			    atomic_cas(&m->state, state, state | MUTEX_WAITERS))
+				break;
+		}
+		WAITER_INIT(&mw.w);
+		mw.handoff = 0;
+		if (requeue)
+			list_add(&mw.w.link, &m->waiters);
+		else
+			list_add_tail(&mw.w.link, &m->waiters);
+		task_park(sync_unlock, m);
+		if (mw.handoff)
+			return;
+		requeue = 1;
+	}
+}
+
+void task_mutex_unlock(struct task_mutex *m) {
+	struct mutexwaiter *mw;
+	struct task *t;
+
+	if (atomic_cas(&m->state, MUTEX_LOCKED, 0))
+		return;
+	// the state only changes under the spinlock while it's locked
+	spin_lock(m);
+	if (list_empty(&m->waiters)) {
+		atomic_store(&m->state, 0);
+		spin_unlock(m);
+		return;
+	}
+	mw = list_first(&m->waiters, struct mutexwaiter, w.link);
+	list_del_init(&mw->w.link);
+	t = mw->w.task;
+	if (nanotime() - mw->since >= MUTEX_STARVE_NS) {
+		mw->handoff = 1;
+		atomic_store(&m->state, list_empty(&m->waiters) ?
+			     MUTEX_LOCKED : MUTEX_LOCKED | MUTEX_WAITERS);
+	} else {
+		atomic_store(&m->state, list_empty(&m->waiters) ? 0 : MUTEX_WAITERS);
+	}
+	spin_unlock(m);
+	task_ready(t);
+}
+
+
+struct condwait {
+	struct waiter w;
+	struct task_cond *c;
+	struct task_mutex *m;
+};
+
+void task_cond_init(struct task_cond *c) {
+	spinlock_init(c);
+	INIT_LIST_HEAD(&c->waiters);
+}
+
+void task_cond_destroy(struct task_cond *c) {
+	spinlock_destroy(c);
+}
+
+// Release the mutex once the waiter is parked, a signal can't come
+// before that.
+static int cond_commit(struct task *t, void *arg) {
+	struct condwait *cw = arg;
+
+	(void)t;
+	spin_unlock(cw->c);
+	task_mutex_unlock(cw->m);
+	return 1;
+}
+
+void task_cond_wait(struct task_cond *c, struct task_mutex *m) {
+	struct condwait cw;
+
+	WAITER_INIT(&cw.w);
+	cw.c = c;
+	cw.m = m;
+	spin_lock(c);
+	list_add_tail(&cw.w.link, &c->waiters);
+	task_park(cond_commit, &cw);
+	task_mutex_lock(m);
+}
+
+void task_cond_signal(struct task_cond *c) {
+	struct waiter *w = NULL;
+
+	spin_lock(c);
+	if (!list_empty(&c->waiters)) {
+		w = list_first(&c->waiters, struct waiter, link);
+		list_del_init(&w->link);
+	}
+	spin_unlock(c);
+	if (w)
+		task_ready(w->task);
+}
+
+// Wake up all the waiters on q, which is private to the caller.
+static void sync_wakeall(struct list_head *q) {
+	struct waiter *w;
+
+	while (!list_empty(q)) {
+		w = list_first(q, struct waiter, link);
+		list_del_init(&w->link);
+		task_ready(w->task);
+	}
+}
+
+void task_cond_broadcast(struct task_cond *c) {
+	struct list_head q;
+
+	INIT_LIST_HEAD(&q);
+	spin_lock(c);
+	list_splice(&c->waiters, &q);
+	spin_unlock(c);
+	sync_wakeall(&q);
+}
+
+
+void task_sema_init(struct task_sema *s, int count) {
+	spinlock_init(s);
+	s->count = count;
+	INIT_LIST_HEAD(&s->waiters);
+}
+
+void task_sema_destroy(struct task_sema *s) {
+	spinlock_destroy(s);
+}
+
+int task_sema_tryacquire(struct task_sema *s) {
+	int count = atomic_load(&s->count);
+
+	while (count > 0) {
+		if (atomic_cas(&s->count, count, count - 1))
+			return 0;
+		count = atomic_load(&s->count);
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+void task_sema_acquire(struct task_sema *s) {
+	struct waiter w;
+
+	if (task_sema_tryacquire(s) == 0)
+		return;
+	spin_lock(s);
+	if (task_sema_tryacquire(s) == 0) {
+		spin_unlock(s);
+		return;
+	}
+	// the releaser hands the unit over
+	WAITER_INIT(&w);
+	list_add_tail(&w.link, &s->waiters);
+	task_park(sync_unlock, s);
+}
+
+void task_sema_release(struct task_sema *s) {
+	struct waiter *w = NULL;
+
+	spin_lock(s);
+	if (!list_empty(&s->waiters)) {
+		w = list_first(&s->waiters, struct waiter, link);
+		list_del_init(&w->link);
+	} else {
+		atomic_add(&s->count, 1);
+	}
+	spin_unlock(s);
+	if (w)
+		task_ready(w->task);
+}
+
+
+void task_waitgroup_init(struct task_waitgroup *wg) {
+	spinlock_init(wg);
+	wg->count = 0;
+	INIT_LIST_HEAD(&wg->waiters);
+}
+
+void task_waitgroup_destroy(struct task_waitgroup *wg) {
+	spinlock_destroy(wg);
+}
+
+void task_waitgroup_add(struct task_waitgroup *wg, int delta) {
+	struct list_head q;
+
+	INIT_LIST_HEAD(&q);
+	spin_lock(wg);
+	if ((wg->count += delta) < 0)
+		BUG_ON();
+	if (!wg->count)
+		list_splice(&wg->waiters, &q);
+	spin_unlock(wg);
+	sync_wakeall(&q);
+}
+
+void task_waitgroup_done(struct task_waitgroup *wg) {
+	task_waitgroup_add(wg, -1);
+}
+
+void task_waitgroup_wait(struct task_waitgroup *wg) {
+	struct waiter w;
+
+	spin_lock(wg);
+	if (!wg->count) {
+		spin_unlock(wg);
+		return;
+	}
+	WAITER_INIT(&w);
+	list_add_tail(&w.link, &wg->waiters);
+	task_park(sync_unlock, wg);
+}
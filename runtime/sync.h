@@ -0,0 +1,65 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+// Sleeping locks for the tasks, see sync.c. a task blocked on them is
+// parked, its thread runs the other tasks meanwhile. the waiters are
+// woken in FIFO order.
+
+#include "list.h"
+#include "spinlock.h"
+
+struct task_mutex {
+	// Lock must be the first field, it guards the waiters
+	struct spinlock Lock;
+	int state;
+	struct list_head waiters;
+};
+
+struct task_cond {
+	struct spinlock Lock;
+	struct list_head waiters;
+};
+
+struct task_sema {
+	struct spinlock Lock;
+	int count;
+	struct list_head waiters;
+};
+
+struct task_waitgroup {
+	struct spinlock Lock;
+	int count;
+	struct list_head waiters;
+};
+
+void task_mutex_init(struct task_mutex *m);
+void task_mutex_destroy(struct task_mutex *m);
+void task_mutex_lock(struct task_mutex *m);
+// Returns 0 if m is taken, -1 with errno EBUSY if it's locked.
+int task_mutex_trylock(struct task_mutex *m);
+void task_mutex_unlock(struct task_mutex *m);
+
+void task_cond_init(struct task_cond *c);
+void task_cond_destroy(struct task_cond *c);
+// Unlock m and park until signaled, m is locked again on return.
+void task_cond_wait(struct task_cond *c, struct task_mutex *m);
+void task_cond_signal(struct task_cond *c);
+void task_cond_broadcast(struct task_cond *c);
+
+void task_sema_init(struct task_sema *s, int count);
+void task_sema_destroy(struct task_sema *s);
+void task_sema_acquire(struct task_sema *s);
+// Returns 0 if a unit is taken, -1 with errno EAGAIN if there is none.
+int task_sema_tryacquire(struct task_sema *s);
+void task_sema_release(struct task_sema *s);
+
+void task_waitgroup_init(struct task_waitgroup *wg);
+void task_waitgroup_destroy(struct task_waitgroup *wg);
+void task_waitgroup_add(struct task_waitgroup *wg, int delta);
+void task_waitgroup_done(struct task_waitgroup *wg);
+// Park until the counter drops to 0.
+void task_waitgroup_wait(struct task_waitgroup *wg);
+
+#endif /* _SYNC_H_ */
@@ -3,10 +3,17 @@
 
 // Wraping the blocking kernel system calls
 // the following are the kernel system calls that actually block continued
-// threads. we wrap it with the NON-BLOCK flag and then yield when what it
-// needed is not ready, let other coroutine run first.
+// threads. we wrap it with the NON-BLOCK flag and then park the task on
+// the netpoller when what it needed is not ready, let other coroutine run
+// first. the descriptors must be closed by sys_close. regular files go
+// through io_uring (see uring_linux.c) when the kernel supports it, the
+// calls which block whatever we do run on the blocking pool instead
+// (see blocking.c).
 //
-// maybe more, not all implemented.
+// maybe more, not all implemented. a call which completes at once is
+// a safe point, see task_safepoint. once the group of the task is
+// cancelled, or the deadline of the task passed, a call which would
+// have to wait fails with ECANCELED or ETIMEDOUT.
 
 #include <stdarg.h>
 #include <sys/types.h>
@@ -18,8 +25,72 @@
 #include <sys/uio.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <netdb.h>
 #include <errno.h>
 #include "task.h"
+#include "runtime.h"
+#include "syscall_linux.h"
+
+// The calls going to the disk wait anyway, they aren't started once
+// the task is cancelled or past its deadline.
+static int sys_giveup(void) {
+	long long deadline = task_deadline();
+
+	if (task_cancelled())
+		errno = ECANCELED;
+	else if (deadline >= 0 && deadline <= nanotime())
+		errno = ETIMEDOUT;
+	else
+		return 0;
+	return 1;
+}
+
+struct sys_rwargs {
+	int op;
+	int fd;
+	const struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+};
+
+static void *sys_rw_blocking(void *arg) {
+	struct sys_rwargs *a = arg;
+
+	if (a->offset < 0)
+		return (void *)(a->op == 'r' ? readv(a->fd, a->iov, a->iovcnt) :
+				writev(a->fd, a->iov, a->iovcnt));
+	return (void *)(a->op == 'r' ? preadv(a->fd, a->iov, a->iovcnt, a->offset) :
+			pwritev(a->fd, a->iov, a->iovcnt, a->offset));
+}
+
+// Regular files never return EAGAIN, they are read and written through
+// the io_uring of the thread if there is one, or on the blocking pool.
+// returns 0 if the request is not taken, the caller does it the old way.
+static int sys_file_rw(int op, int fd, const struct iovec *iov, int iovcnt,
+		       off_t offset, ssize_t *ret) {
+	struct sys_rwargs a = {op, fd, iov, iovcnt, offset};
+	long long res;
+
+	if (!netpoll_isfile(fd))
+		return 0;
+	if (sys_giveup()) {
+		*ret = -1;
+		return 1;
+	}
+	if (!uring_rw(op, fd, iov, iovcnt, offset, &res)) {
+		*ret = (ssize_t)task_blocking(sys_rw_blocking, &a);
+		return 1;
+	}
+	if (res < 0) {
+		errno = -res;
+		*ret = -1;
+	} else {
+		*ret = res;
+	}
+	return 1;
+}
+
 
 // sockfd must set the O_NONBLOCK file status flag by fcntl.
 int sys_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
@@ -27,25 +98,103 @@ int sys_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
  RETRY:
 	ret = accept(sockfd, addr, addrlen);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(sockfd, 'r', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
 
+struct sys_openargs {
+	const char *pathname;
+	int flags;
+	mode_t mode;
+};
+
+static void *sys_open_blocking(void *arg) {
+	struct sys_openargs *a = arg;
+
+	return (void *)(long)open(a->pathname, a->flags, a->mode);
+}
+
+// O_NONBLOCK only helps the fifos and the devices, opening a file may
+// still wait for the disk.
 int sys_open(const char *pathname, int flags, mode_t mode) {
+	// the open function default behavior: O_NONBLOCK
+	struct sys_openargs a = {pathname, flags|O_NONBLOCK, mode};
 	int ret;
  RETRY:
-	// the open function default behavior: O_NONBLOCK
-	ret = open(pathname, flags|O_NONBLOCK, mode);
+	if (sys_giveup())
+		return -1;
+	ret = (long)task_blocking(sys_open_blocking, &a);
 	if (ret == -1 && errno == EAGAIN) {
 		yield();
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
+int sys_close(int fd) {
+	netpoll_close(fd);
+	return close(fd);
+}
+
+struct sys_statargs {
+	const char *pathname;
+	struct stat *buf;
+};
+
+static void *sys_stat_blocking(void *arg) {
+	struct sys_statargs *a = arg;
+
+	return (void *)(long)stat(a->pathname, a->buf);
+}
+
+int sys_stat(const char *pathname, struct stat *buf) {
+	struct sys_statargs a = {pathname, buf};
+
+	if (sys_giveup())
+		return -1;
+	return (long)task_blocking(sys_stat_blocking, &a);
+}
+
+static void *sys_fsync_blocking(void *arg) {
+	return (void *)(long)fsync((long)arg);
+}
+
+int sys_fsync(int fd) {
+	if (sys_giveup())
+		return -1;
+	return (long)task_blocking(sys_fsync_blocking, (void *)(long)fd);
+}
+
+struct sys_getaddrinfoargs {
+	const char *node;
+	const char *service;
+	const struct addrinfo *hints;
+	struct addrinfo **res;
+};
+
+static void *sys_getaddrinfo_blocking(void *arg) {
+	struct sys_getaddrinfoargs *a = arg;
+
+	return (void *)(long)getaddrinfo(a->node, a->service, a->hints, a->res);
+}
+
+// Returns the EAI_* code as getaddrinfo does, EAI_SYSTEM with errno
+// ECANCELED or ETIMEDOUT if the task gives up.
+int sys_getaddrinfo(const char *node, const char *service,
+		    const struct addrinfo *hints, struct addrinfo **res) {
+	struct sys_getaddrinfoargs a = {node, service, hints, res};
+
+	if (sys_giveup())
+		return EAI_SYSTEM;
+	return (long)task_blocking(sys_getaddrinfo_blocking, &a);
+}
+
 int sys_fcntl(int fd, int cmd, ... /* arg */) {
 	va_list args;
 	int ret;
@@ -61,96 +210,228 @@ int sys_fcntl(int fd, int cmd, ... /* arg */) {
 }
 
 
+// A private epoll instance watching the descriptors of a poll or a
+// select, the task parks on it through the netpoller. a descriptor epoll
+// can't watch is a regular file, which poll already reported ready.
+static int sys_pollset(struct pollfd *fds, nfds_t nfds) {
+	struct epoll_event ev;
+	nfds_t i;
+	int ep;
+
+	if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return -1;
+	for (i = 0; i < nfds; i++) {
+		if (fds[i].fd < 0)
+			continue;
+		ev.events = fds[i].events & (EPOLLIN|EPOLLPRI|EPOLLOUT|EPOLLRDHUP);
+		ev.data.fd = fds[i].fd;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fds[i].fd, &ev) < 0 && errno == EEXIST) {
+			// the same fd twice, watch the union of the events
+			ev.events |= fds[i].events;
+			epoll_ctl(ep, EPOLL_CTL_MOD, fds[i].fd, &ev);
+		}
+	}
+	return ep;
+}
+
+// Park on the pollset until something is ready or the deadline passed,
+// returns 0 on timeout.
+// 0 when the deadline of the caller passed, the deadline of the task
+// is an error like in the other sys_* calls.
+static int sys_pollwait(int ep, long long deadline) {
+	if (netpoll_wait(ep, 'r', deadline) < 0) {
+		if (errno == ETIMEDOUT && deadline >= 0 && nanotime() >= deadline)
+			return 0;
+		return -1;
+	}
+	return 1;
+}
+
+static void sys_pollclose(int ep) {
+	int err = errno;
+
+	sys_close(ep);
+	errno = err;
+}
+
 int sys_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
-	int ret;
- RETRY:
+	long long deadline;
+	int ret, ep;
+
 	// A value of 0 indicates that the call timed out and no
-	// file descriptors were ready. so we yield the thread.
-	if ((ret = poll(fds, nfds, 0)) == 0) {
-		yield();
-		goto RETRY;
+	// file descriptors were ready. so we park the task until
+	// one of them is ready or the timeout.
+	if ((ret = poll(fds, nfds, 0)) != 0 || timeout == 0)
+		return ret;
+	deadline = timeout < 0 ? -1 : nanotime() + timeout * 1000000LL;
+	if ((ep = sys_pollset(fds, nfds)) < 0)
+		return -1;
+	while ((ret = sys_pollwait(ep, deadline)) > 0) {
+		if ((ret = poll(fds, nfds, 0)) != 0)
+			break;
 	}
+	sys_pollclose(ep);
 	return ret;
 }
 
 int sys_select(int nfds, fd_set *readfds, fd_set *writefds,
 	       fd_set *exceptfds, struct timeval *timeout) {
-	int ret;
 	struct timeval nonblock = {0, 0};
- RETRY:
-	if ((ret = select(nfds, readfds,
-			  writefds, exceptfds, &nonblock)) == 0) {
-		yield();
-		goto RETRY;
+	struct pollfd fds[FD_SETSIZE];
+	fd_set rfds, wfds, efds;
+	long long deadline;
+	int i, n, ret, ep;
+
+	if (readfds)
+		rfds = *readfds;
+	if (writefds)
+		wfds = *writefds;
+	if (exceptfds)
+		efds = *exceptfds;
+	if ((ret = select(nfds, readfds, writefds, exceptfds, &nonblock)) != 0 ||
+	    (timeout && !timeout->tv_sec && !timeout->tv_usec))
+		return ret;
+	deadline = !timeout ? -1 : nanotime() +
+		timeout->tv_sec * 1000000000LL + timeout->tv_usec * 1000LL;
+
+	for (i = 0, n = 0; i < nfds && i < FD_SETSIZE; i++) {
+		fds[n].fd = i;
+		fds[n].events = 0;
+		if (readfds && FD_ISSET(i, &rfds))
+			fds[n].events |= POLLIN;
+		if (writefds && FD_ISSET(i, &wfds))
+			fds[n].events |= POLLOUT;
+		if (exceptfds && FD_ISSET(i, &efds))
+			fds[n].events |= POLLPRI;
+		if (fds[n].events)
+			n++;
+	}
+	if ((ep = sys_pollset(fds, n)) < 0)
+		return -1;
+	// the sets are cleared by the last select on timeout
+	while ((ret = sys_pollwait(ep, deadline)) > 0) {
+		if (readfds)
+			*readfds = rfds;
+		if (writefds)
+			*writefds = wfds;
+		if (exceptfds)
+			*exceptfds = efds;
+		if ((ret = select(nfds, readfds, writefds, exceptfds, &nonblock)) != 0)
+			break;
 	}
+	sys_pollclose(ep);
 	return ret;
 }
 
 
 ssize_t sys_read(int fd, void *buf, size_t count) {
 	ssize_t ret;
+	struct iovec iov = {buf, count};
+
+	if (sys_file_rw('r', fd, &iov, 1, -1, &ret))
+		return ret;
  RETRY:
 	ret = read(fd, buf, count);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(fd, 'r', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
 ssize_t sys_write(int fd, void *buf, ssize_t count) {
 	ssize_t ret;
+	struct iovec iov = {buf, count};
+
+	if (sys_file_rw('w', fd, &iov, 1, -1, &ret))
+		return ret;
  RETRY:
 	ret = write(fd, buf, count);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(fd, 'w', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
 ssize_t sys_readv(int fd, const struct iovec *iov, int iovcnt) {
 	ssize_t ret;
+
+	if (sys_file_rw('r', fd, iov, iovcnt, -1, &ret))
+		return ret;
  RETRY:
 	ret = readv(fd, iov, iovcnt);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(fd, 'r', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
 ssize_t sys_writev(int fd, const struct iovec *iov, int iovcnt) {
 	ssize_t ret;
+
+	if (sys_file_rw('w', fd, iov, iovcnt, -1, &ret))
+		return ret;
  RETRY:
 	ret = writev(fd, iov, iovcnt);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(fd, 'w', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
+ssize_t sys_pread(int fd, void *buf, size_t count, off_t offset) {
+	struct iovec iov = {buf, count};
+
+	return sys_preadv(fd, &iov, 1, offset);
+}
+
+ssize_t sys_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+	struct iovec iov = {(void *)buf, count};
+
+	return sys_pwritev(fd, &iov, 1, offset);
+}
+
 ssize_t sys_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
 	ssize_t ret;
+
+	if (sys_file_rw('r', fd, iov, iovcnt, offset, &ret))
+		return ret;
  RETRY:
 	ret = preadv(fd, iov, iovcnt, offset);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(fd, 'r', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
 
 ssize_t sys_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
 	ssize_t ret;
+
+	if (sys_file_rw('w', fd, iov, iovcnt, offset, &ret))
+		return ret;
  RETRY:
 	ret = pwritev(fd, iov, iovcnt, offset);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(fd, 'w', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
@@ -159,9 +440,11 @@ ssize_t sys_send(int sockfd, const void *buf, size_t len, int flags) {
  RETRY:
 	ret = send(sockfd, buf, len, flags);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(sockfd, 'w', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
@@ -171,9 +454,11 @@ ssize_t sys_sendto(int sockfd, const void *buf, size_t len, int flags,
  RETRY:
 	ret = sendto(sockfd, buf, len, flags, dest_addr, addrlen);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(sockfd, 'w', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
@@ -183,9 +468,11 @@ ssize_t sys_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
  RETRY:
 	ret = sendmsg(sockfd, msg, flags);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(sockfd, 'w', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
@@ -195,9 +482,11 @@ ssize_t sys_recv(int sockfd, void *buf, size_t len, int flags) {
  RETRY:
 	ret = recv(sockfd, buf, len, flags);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(sockfd, 'r', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
@@ -207,9 +496,11 @@ ssize_t sys_recvfrom(int sockfd, void *buf, size_t len, int flags,
  RETRY:
 	ret = recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(sockfd, 'r', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
 
@@ -219,8 +510,10 @@ ssize_t sys_recvmsg(int sockfd, struct msghdr *msg, int flags) {
  RETRY:
 	ret = recvmsg(sockfd, msg, flags);
 	if (ret == -1 && errno == EAGAIN) {
-		yield();
+		if (netpoll_wait(sockfd, 'r', -1) < 0)
+			return -1;
 		goto RETRY;
 	}
+	task_safepoint();
 	return ret;
 }
@@ -0,0 +1,48 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+#ifndef _SYSCALL_LINUX_H_
+#define _SYSCALL_LINUX_H_
+
+// The blocking system calls wrapped for the tasks, see syscall_linux.c.
+// the descriptors must have O_NONBLOCK set, and must be closed by
+// sys_close once a task has waited on them.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <poll.h>
+
+int sys_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+int sys_open(const char *pathname, int flags, mode_t mode);
+int sys_close(int fd);
+// These block whatever the flags, they run on the blocking pool.
+int sys_stat(const char *pathname, struct stat *buf);
+int sys_fsync(int fd);
+int sys_getaddrinfo(const char *node, const char *service,
+		    const struct addrinfo *hints, struct addrinfo **res);
+int sys_fcntl(int fd, int cmd, ... /* arg */);
+int sys_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int sys_select(int nfds, fd_set *readfds, fd_set *writefds,
+	       fd_set *exceptfds, struct timeval *timeout);
+ssize_t sys_read(int fd, void *buf, size_t count);
+ssize_t sys_write(int fd, void *buf, ssize_t count);
+ssize_t sys_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t sys_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t sys_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t sys_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t sys_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t sys_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t sys_send(int sockfd, const void *buf, size_t len, int flags);
+ssize_t sys_sendto(int sockfd, const void *buf, size_t len, int flags,
+		   const struct sockaddr *dest_addr, socklen_t addrlen);
+ssize_t sys_sendmsg(int sockfd, const struct msghdr *msg, int flags);
+ssize_t sys_recv(int sockfd, void *buf, size_t len, int flags);
+ssize_t sys_recvfrom(int sockfd, void *buf, size_t len, int flags,
+		     struct sockaddr *src_addr, socklen_t *addrlen);
+ssize_t sys_recvmsg(int sockfd, struct msghdr *msg, int flags);
+
+
+#endif /* _SYSCALL_LINUX_H_ */
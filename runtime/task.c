@@ -4,11 +4,14 @@
 
 #include "task.h"
 #include "runtime.h"
+#include "malloc.h"
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <signal.h>
+#include <errno.h>
 
 #ifdef VALGRIND
 #include <valgrind/valgrind.h>
@@ -18,13 +21,20 @@ struct TaskQueue {
 	// Lock must be the first field
 	struct spinlock Lock;
 	struct list_head queue;
+	int size;
 };
 
-static struct TaskQueue taskqueue;
+// The global taskqueue is only the overflow and injection path now.
+// tasks created outside of the scheduler and the half of a local run
+// queue that doesn't fit any more are put here, every thread picks up
+// a batch of them when it's local run queue is empty. it's FIFO, the
+// tasks waiting longest go first. there is one per priority level.
+static struct TaskQueue taskqueue[TASK_PRIO_LEVELS];
 
 static void taskqueue_init(struct TaskQueue *tq) {
 	spinlock_init(tq);
 	INIT_LIST_HEAD(&tq->queue);
+	tq->size = 0;
 }
 
 static void taskqueue_exit(struct TaskQueue *tq) {
@@ -49,42 +59,113 @@ static void taskqueue_free(struct TaskQueue *tq) {
 
 static int taskqueue_push(struct TaskQueue *tq, struct task *t) {
 	spin_lock(tq);
-	list_add(&t->alllink, &tq->queue);
+	list_add_tail(&t->alllink, &tq->queue);
+	tq->size++;
 	spin_unlock(tq);
 	return 0;
 }
 
-static struct task *taskqueue_pop(struct TaskQueue *tq) {
-	struct task *t;
-
+// Put a private list of n tasks into the queue with one lock round
+static void taskqueue_pushlist(struct TaskQueue *tq, struct list_head *head, int n) {
 	spin_lock(tq);
-	if (list_empty(&tq->queue)) {
-		spin_unlock(tq);
-		return NULL;
-	}
-	t = list_first(&tq->queue, struct task, alllink);
-	list_del(&t->alllink);
+	list_splice_tail(head, &tq->queue);
+	tq->size += n;
 	spin_unlock(tq);
-	return t;
 }
 
 
 
-
-
+// Per thread local run queue. a bounded ring buffer, only the owner
+// thread puts tasks on the tail, the owner and the thieves take tasks
+// from the head by cas, so the owner never needs a lock.
+//
+// In front of the ring there is the runnext slot for the task just
+// spawned or woken by the running task. it runs next and inherits the
+// time slice, so a producer and its consumer keep running back to back
+// on one thread with their data in cache. once such a chain has run for
+// the time slice, runnext goes to the tail and the ring gets its turn.
+// thieves only take runnext when there is nothing else to steal.
+//
+// There is a ring per priority level. the highest level with tasks
+// goes first, but a lower level passed over PRIO_AGE times in a row
+// gets a turn, so the background work ages up instead of starving.
+// the global queue is served the same way.
+
+#define RUNQ_SIZE 256
+#define TASK_SLICE_NS 10000000LL
+#define PRIO_AGE 8
+
+// the time slice, 0 means no limit
+static long long timeslice = TASK_SLICE_NS;
+
+struct runq {
+	unsigned int head;	// consumers, cas
+	unsigned int tail;	// producer, owner only
+	struct task *ring[RUNQ_SIZE];
+};
 
 struct thread {
 	pthread_t pid;
-	ucontext_t ucp;
+	int ktid;		// kernel thread id
+	int id;
+	unsigned int schedtick;	// incremented on every scheduling
+	unsigned int fastrand;
+	struct context ctx;	// the scheduler context
 	void (*mainfunc)(void *args);
 	void *args;
 	void *stackguard;
 	int stacksize;
 	struct task *task0; // current running task on this thread;
+	struct runq runq[TASK_PRIO_LEVELS];
+	unsigned int runqage[TASK_PRIO_LEVELS];	// passed over in a row
+	unsigned int globage[TASK_PRIO_LEVELS];
+	struct task *runnext;
+	unsigned int slicetick;	// tasks run from runnext in a row
+	long long slicestart;
+
+	// the task running since schedtick preempttick is asked to give
+	// up the thread, the sysmon fields are owned by the monitor.
+	int preempt;
+	unsigned int preempttick;
+	unsigned int sysmontick;
+	long long sysmonwhen;
+	int blocked;
+
+	void *sigstack;		// for reporting the stack overflow
+
+	// the timers added on this thread
+	struct timers timers;
+
+	// idle thread sleeps on park until it's unparked
+	unsigned int park;
+	int spinning;
+	struct list_head idlelink;
+
+	// commit of the task parking on this thread
+	int (*parkcommit)(struct task *t, void *arg);
+	void *parkarg;
+
+	// the task which switched away last, finished by whoever runs next
+	struct task *prev;
+
+	// cache of the stopped tasks, they keep their stacks
+	struct list_head taskcache;
+	int ntaskcache;
+
+	// the cpu it's bound to and its NUMA node, -1 if not bound
+	int cpu;
+	int node;
 
 	struct list_head alllink;
 };
 
+#define MAXTHREADS 256
+
+// all the threads take participate in the scheduling, the victims
+// for work stealing.
+static struct thread *allthreads[MAXTHREADS];
+static int nthreads;
+
 struct ThreadQueue {
 	// Lock must be the first field
 	struct spinlock Lock;
@@ -145,28 +226,57 @@ static pthread_key_t thread_key;
 
 static struct thread *thread_alloc(void (*mainfunc)(void *args), void *args) {
 	struct thread *thread;
+	int id;
 
-	if (!(thread = malloc(sizeof(*thread))))
+	if ((id = atomic_add(&nthreads, 1) - 1) >= MAXTHREADS) {
+		atomic_sub(&nthreads, 1);
 		return NULL;
+	}
+	if (!(thread = malloc(sizeof(*thread)))) {
+		atomic_sub(&nthreads, 1);
+		return NULL;
+	}
 	memset(thread, 0, sizeof(*thread));
+	thread->id = id;
+	thread->fastrand = id + 1;
 	thread->mainfunc = mainfunc;
 	thread->args = args;
+	INIT_LIST_HEAD(&thread->taskcache);
+	thread->cpu = -1;
+	thread->node = -1;
+	INIT_LIST_HEAD(&thread->idlelink);
+	timers_init(&thread->timers);
+	atomic_store(&allthreads[id], thread);
 	return thread;
 }
 
 
+// Thieves may look at any registered thread, so the thread must only
+// be freed after all the threads have left the scheduler.
 static void thread_free(struct thread *thread) {
+	atomic_store(&allthreads[thread->id], NULL);
+	timers_destroy(&thread->timers);
+	free(thread->sigstack);
 	free(thread);
 }
 
-static void thread_create(void (*mainfunc)(void *args), void *args, int stacksize) {
+static unsigned int fastrand(struct thread *thread) {
+	unsigned int x = thread->fastrand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return thread->fastrand = x;
+}
+
+static int thread_create(void (*mainfunc)(void *args), void *args, int stacksize) {
 
 	struct thread *thread;
 	pthread_attr_t pth_attr;
 
 	if (0 != pthread_attr_init(&pth_attr)) {
 		fprintf(stderr, "pthread_attr_init failed\n");
-		return;
+		return -1;
 	}
 	if (stacksize > 0 && 0 != pthread_attr_setstacksize(&pth_attr, stacksize)) {
 		fprintf(stderr, "pthread_attr_setstacksize failed\n");
@@ -178,94 +288,1058 @@ static void thread_create(void (*mainfunc)(void *args), void *args, int stacksiz
 		fprintf(stderr, "thread_alloc failed\n");
 		goto MEM_ERROR;
 	}
-	threadqueue_push(&threadqueue, thread);
 	if (0 != pthread_create(&thread->pid, &pth_attr, (void *(*)(void *))mainfunc, thread)) {
 		fprintf(stderr, "pthread_create failed\n");
 		goto PTHREAD_ERROR;
 	}
+	threadqueue_push(&threadqueue, thread);
 	pthread_attr_destroy(&pth_attr);
-	return;
+	return 0;
 
  PTHREAD_ERROR:
 	thread_free(thread);
  MEM_ERROR:
  STACKSIZE_ERROR:
 	pthread_attr_destroy(&pth_attr);
+	return -1;
+}
+
+
+
+// Idle threads spin for a while looking for work, and then park on a
+// futex. new work wakes up one idle thread unless a spinning thread is
+// about to find it. the runtime shuts down once all the tasks stopped,
+// a task waiting for I/O or a timer is still a live task.
+#define SPIN_ROUNDS 64
+
+static struct {
+	// Lock must be the first field
+	struct spinlock Lock;
+	struct list_head idle;
+	int nidle;
+	int nspinning;
+	int ntasks;		// live tasks
+	int shutdown;
+	int netpolling;		// a thread is blocked in netpoll
+
+	// the threads stuck in the kernel don't count for maxprocs, a
+	// spare thread runs in place of each. the spares not needed any
+	// more park on the spare list.
+	int nblocked;
+	struct list_head spare;
+	int nspare;
+} sched;
+
+static void thread_park(struct thread *thread) {
+	while (!atomic_load(&thread->park))
+		futexsleep(&thread->park, 0, -1);
+	atomic_store(&thread->park, 0);
+}
+
+static void thread_unpark(struct thread *thread) {
+	atomic_store(&thread->park, 1);
+	futexwakeup(&thread->park, 1);
+}
+
+// Wake up an idle thread for the new work.
+static void wakep(void) {
+	struct thread *thread;
+
+	if (atomic_load(&sched.nspinning))
+		return;
+	if (!atomic_load(&sched.nidle))
+		goto NETPOLL;
+	spin_lock(&sched);
+	if (list_empty(&sched.idle)) {
+		spin_unlock(&sched);
+		goto NETPOLL;
+	}
+	thread = list_first(&sched.idle, struct thread, idlelink);
+	list_del_init(&thread->idlelink);
+	atomic_sub(&sched.nidle, 1);
+	// it's spinning from now on, so the others stay asleep
+	thread->spinning = 1;
+	atomic_add(&sched.nspinning, 1);
+	spin_unlock(&sched);
+	thread_unpark(thread);
 	return;
+
+ NETPOLL:
+	// no thread asleep on the futex, the thread blocked in netpoll
+	// is the only one can take the work.
+	if (atomic_load(&sched.netpolling))
+		netpoll_break();
 }
 
+// Wake up to n idle threads for a batch of new work, they start
+// spinning once they are up.
+static void wakepn(int n) {
+	struct thread *thread;
 
+	if (n <= 1) {
+		wakep();
+		return;
+	}
+	if (atomic_load(&sched.nidle)) {
+		spin_lock(&sched);
+		while (n && !list_empty(&sched.idle)) {
+			thread = list_first(&sched.idle, struct thread, idlelink);
+			list_del_init(&thread->idlelink);
+			atomic_sub(&sched.nidle, 1);
+			thread_unpark(thread);
+			n--;
+		}
+		spin_unlock(&sched);
+	}
+	if (n && atomic_load(&sched.netpolling))
+		netpoll_break();
+}
 
+static void idle_put(struct thread *thread) {
+	spin_lock(&sched);
+	list_add(&thread->idlelink, &sched.idle);
+	atomic_add(&sched.nidle, 1);
+	spin_unlock(&sched);
+}
 
+// Take thread off the idle list, return 0 if somebody else did it and
+// is going to unpark it.
+static int idle_del(struct thread *thread) {
+	int ret = 0;
 
-static void task_switch(ucontext_t *from, ucontext_t *to) {
-	if (swapcontext(from, to) < 0) {
-		fprintf(stderr, "swapcontext failed\n");
-		BUG_ON();
+	spin_lock(&sched);
+	if (!list_empty(&thread->idlelink)) {
+		list_del_init(&thread->idlelink);
+		atomic_sub(&sched.nidle, 1);
+		ret = 1;
 	}
+	spin_unlock(&sched);
+	return ret;
 }
 
+struct timers *timers_local(void) {
+	struct thread *thread = pthread_getspecific(thread_key);
+
+	return thread ? &thread->timers : NULL;
+}
+
+// The nearest deadline of all the threads, -1 if there is no timer.
+static long long timers_nearest(void) {
+	struct thread *thread;
+	long long next, min = -1;
+	int i, n = atomic_load(&nthreads);
+
+	for (i = 0; i < n; i++) {
+		if (!(thread = atomic_load(&allthreads[i])))
+			continue;
+		if ((next = timers_next(&thread->timers)) >= 0 && (min < 0 || next < min))
+			min = next;
+	}
+	return min;
+}
+
+// Run the expired timers of thread, their tasks go to the run queue of
+// the current thread.
+static int thread_timers_run(struct thread *thread, long long now) {
+	long long next;
+
+	if ((next = timers_next(&thread->timers)) < 0 || next > now)
+		return 0;
+	return timers_run(&thread->timers, now);
+}
+
+static void timers_runall(long long now) {
+	struct thread *thread;
+	int i, n = atomic_load(&nthreads);
+
+	for (i = 0; i < n; i++)
+		if ((thread = atomic_load(&allthreads[i])))
+			thread_timers_run(thread, now);
+}
+
+void timer_wakeup(void) {
+	if (atomic_load(&sched.netpolling))
+		netpoll_break();
+	else
+		wakep();
+}
+
+static void task_stopped(void) {
+	struct thread *thread;
+
+	if (atomic_sub(&sched.ntasks, 1))
+		return;
+	// the last task stopped, wake up everybody to exit
+	atomic_store(&sched.shutdown, 1);
+	spin_lock(&sched);
+	while (!list_empty(&sched.idle)) {
+		thread = list_first(&sched.idle, struct thread, idlelink);
+		list_del_init(&thread->idlelink);
+		atomic_sub(&sched.nidle, 1);
+		thread_unpark(thread);
+	}
+	while (!list_empty(&sched.spare)) {
+		thread = list_first(&sched.spare, struct thread, idlelink);
+		list_del_init(&thread->idlelink);
+		atomic_sub(&sched.nspare, 1);
+		thread_unpark(thread);
+	}
+	spin_unlock(&sched);
+	netpoll_break();
+	blocking_shutdown();
+}
+
+
+
+// The number of threads running the scheduler, include the main
+// thread. 0 means not configured: the GOGOMAXPROCS environment
+// variable or the number of online cpus is used at startup.
+static int maxprocs;
+static int procstarted;
+
+static int maxprocs_init(void) {
+	char *env;
+	int n = 0;
+
+	if (maxprocs > 0)
+		n = maxprocs;
+	else if ((env = getenv("GOGOMAXPROCS")) && (n = atoi(env)) > 0)
+		;
+	else if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+	if (n > MAXTHREADS)
+		n = MAXTHREADS;
+	return n;
+}
+
+static void thread_start(void *args);
+
+// The scheduler runs on the pthread stack, the netpoller and the
+// io_uring reaping need more than PTHREAD_STACK_MIN.
+#define THREAD_STACK_SIZE (256 * 1024)
+
+// Park thread as a spare if more threads are running than maxprocs and
+// the blocked ones, it's woken up by sysmon for the next blocked one.
+static int thread_retire(struct thread *thread) {
+	spin_lock(&sched);
+	if (atomic_load(&sched.shutdown) ||
+	    atomic_load(&nthreads) - atomic_load(&sched.nspare) <=
+	    atomic_load(&maxprocs) + atomic_load(&sched.nblocked)) {
+		spin_unlock(&sched);
+		return 0;
+	}
+	list_add(&thread->idlelink, &sched.spare);
+	atomic_add(&sched.nspare, 1);
+	spin_unlock(&sched);
+	return 1;
+}
+
+// Run a spare thread in place of a blocked one, start a new one if
+// there is none.
+static int thread_handoff(void) {
+	struct thread *thread;
+
+	spin_lock(&sched);
+	if (!list_empty(&sched.spare)) {
+		thread = list_first(&sched.spare, struct thread, idlelink);
+		list_del_init(&thread->idlelink);
+		atomic_sub(&sched.nspare, 1);
+		spin_unlock(&sched);
+		thread_unpark(thread);
+		return 0;
+	}
+	spin_unlock(&sched);
+	return thread_create(thread_start, NULL, THREAD_STACK_SIZE);
+}
+
+// Run the scheduler threads until n of them are running besides the
+// blocked ones, the spares go first. the thread slot of a failed start
+// is lost, so never retry.
+static void procs_grow(int n) {
+	while (atomic_load(&nthreads) - atomic_load(&sched.nspare) <
+	       n + atomic_load(&sched.nblocked)) {
+		if (thread_handoff() < 0)
+			break;
+	}
+}
+
+int task_setmaxprocs(int n) {
+	int old;
+
+	if (n > MAXTHREADS)
+		n = MAXTHREADS;
+	if (!atomic_load(&procstarted)) {
+		old = maxprocs_init();
+		if (n > 0)
+			maxprocs = n;
+		return old;
+	}
+	old = atomic_load(&maxprocs);
+	if (n > old && atomic_cas(&maxprocs, old, n))
+		procs_grow(n);
+	return old;
+}
+
+// Whether the scheduler threads are bound to the cpus, -1 until it's
+// configured. the GOGOAFFINITY environment variable is the default.
+static int affinity = -1;
+
+static int affinity_init(void) {
+	char *env;
+
+	if (affinity >= 0)
+		return affinity;
+	return (env = getenv("GOGOAFFINITY")) && atoi(env) > 0;
+}
+
+int task_setaffinity(int on) {
+	int old;
+
+	if (!atomic_load(&procstarted)) {
+		old = affinity_init();
+		if (on >= 0)
+			affinity = on > 0;
+		return old;
+	}
+	if (on >= 0 && (on > 0) != affinity) {
+		errno = EBUSY;
+		return -1;
+	}
+	return affinity;
+}
+
+// Bind thread to the cpu picked for its id. the cpus are sorted by
+// node, so the threads fill up a NUMA node before the next one.
+static void thread_bind(struct thread *thread) {
+	int cpu, node;
+
+	if (!affinity || (cpu = sys_cpu_pick(thread->id, &node)) < 0)
+		return;
+	if (sys_thread_bind(cpu) < 0)
+		return;
+	thread->cpu = cpu;
+	atomic_store(&thread->node, node);
+}
+
+// Put t on the local run queue of thread, in runnext if next is set,
+// the task kicked out of runnext goes to the tail. if the local queue
+// is full, move half of it with t to the global queue.
+static void runqput(struct thread *thread, struct task *t, int next) {
+	struct task *grab[RUNQ_SIZE / 2];
+	struct list_head batch;
+	unsigned int h, tl, n, i;
+	struct runq *q;
+	int l;
+
+	if (next && !(t = atomic_xchg(&thread->runnext, t)))
+		return;
+	l = atomic_load(&t->prio);
+	q = &thread->runq[l];
+ RETRY:
+	h = atomic_load(&q->head);
+	tl = q->tail;
+	if (tl - h < RUNQ_SIZE) {
+		q->ring[tl % RUNQ_SIZE] = t;
+		atomic_store(&q->tail, tl + 1);
+		return;
+	}
+
+	// the queue is full, grab the half of it for the global queue.
+	// the tasks are only ours once the cas succeeds, a thief may be
+	// running them already, so don't touch them before.
+	n = (tl - h) / 2;
+	for (i = 0; i < n; i++)
+		grab[i] = q->ring[(h + i) % RUNQ_SIZE];
+	if (!atomic_cas(&q->head, h, h + n))
+		goto RETRY;	// thieves took some, the queue is not full anymore
+	INIT_LIST_HEAD(&batch);
+	for (i = 0; i < n; i++)
+		list_add_tail(&grab[i]->alllink, &batch);
+	list_add_tail(&t->alllink, &batch);
+	taskqueue_pushlist(&taskqueue[l], &batch, n + 1);
+}
+
+// Put a private list of n tasks of one level on the local run queue of
+// thread with one store of the tail, the ones that don't fit go to the
+// global queue with one lock round.
+static void runqputlist(struct thread *thread, struct list_head *head, int n) {
+	int l = atomic_load(&list_first(head, struct task, alllink)->prio);
+	struct runq *q = &thread->runq[l];
+	struct task *t;
+	unsigned int h, tl;
+
+	h = atomic_load(&q->head);
+	tl = q->tail;
+	while (n && tl - h < RUNQ_SIZE) {
+		t = list_first(head, struct task, alllink);
+		list_del(&t->alllink);
+		q->ring[tl++ % RUNQ_SIZE] = t;
+		n--;
+	}
+	atomic_store(&q->tail, tl);
+	if (n)
+		taskqueue_pushlist(&taskqueue[l], head, n);
+}
+
+// Whether the tasks run from runnext in a row have used up their time
+// slice, the clock is only read every 16 of them.
+static int runq_sliceout(struct thread *thread) {
+	long long slice;
+
+	if (++thread->slicetick % 16)
+		return 0;
+	if (thread->slicetick == 16) {
+		thread->slicestart = nanotime();
+		return 0;
+	}
+	slice = atomic_load(&timeslice);
+	return slice > 0 && nanotime() - thread->slicestart >= slice;
+}
+
+// The level to serve among the ones set in mask: the highest, unless
+// a lower one has been passed over PRIO_AGE times.
+static int prio_pick(unsigned int *age, int mask) {
+	int l, top = __builtin_ctz(mask);
+
+	for (l = TASK_PRIO_LEVELS - 1; l > top; l--) {
+		if (!(mask & (1 << l)))
+			continue;
+		if (++age[l] >= PRIO_AGE) {
+			age[l] = 0;
+			return l;
+		}
+	}
+	age[top] = 0;
+	return top;
+}
+
+// The levels of the local run queue which have tasks, a bit each.
+static int runq_levels(struct thread *thread) {
+	int l, mask = 0;
+
+	for (l = 0; l < TASK_PRIO_LEVELS; l++)
+		if (atomic_load(&thread->runq[l].head) != thread->runq[l].tail)
+			mask |= 1 << l;
+	return mask;
+}
+
+// Get a task from the local run queue, owner only. runnext goes back
+// to the ring when a higher level has tasks.
+static struct task *runqget(struct thread *thread) {
+	struct runq *q;
+	struct task *t;
+	unsigned int h;
+	int l, mask = runq_levels(thread);
+
+	if ((t = atomic_load(&thread->runnext)) && atomic_cas(&thread->runnext, t, NULL)) {
+		if ((!mask || atomic_load(&t->prio) <= __builtin_ctz(mask)) &&
+		    !runq_sliceout(thread))
+			return t;
+		runqput(thread, t, 0);
+		mask = runq_levels(thread);
+	}
+	thread->slicetick = 0;
+	while (mask) {
+		l = prio_pick(thread->runqage, mask);
+		q = &thread->runq[l];
+		for (;;) {
+			h = atomic_load(&q->head);
+			if (h == q->tail)
+				break;
+			t = q->ring[h % RUNQ_SIZE];
+			if (atomic_cas(&q->head, h, h + 1))
+				return t;
+		}
+		// the thieves emptied it meanwhile
+		mask &= ~(1 << l);
+	}
+	return NULL;
+}
+
+// Steal half of the tasks of the highest level from victim's run
+// queue into thread's run queue, the thread's run queue must be empty.
+// return one of the stolen tasks or NULL. the victim's runnext is only
+// taken if stealnext is set and its rings are empty.
+static struct task *runqsteal(struct thread *thread, struct thread *victim, int stealnext) {
+	struct runq *q, *vq;
+	unsigned int h, tl, vh, vtl, n, i;
+	struct task *t;
+	int l;
+
+	for (l = 0; l < TASK_PRIO_LEVELS; l++) {
+		q = &thread->runq[l];
+		vq = &victim->runq[l];
+		tl = q->tail;
+		h = atomic_load(&q->head);
+		if (tl != h)
+			BUG_ON();
+		for (;;) {
+			vh = atomic_load(&vq->head);
+			vtl = atomic_load(&vq->tail);
+			n = vtl - vh;
+			n = n - n / 2;
+			if (n == 0)
+				break;
+			if (n > RUNQ_SIZE / 2)
+				continue;	// inconsistent head and tail
+			for (i = 0; i < n; i++)
+				q->ring[(tl + i) % RUNQ_SIZE] = vq->ring[(vh + i) % RUNQ_SIZE];
+			if (atomic_cas(&vq->head, vh, vh + n))
+				goto STOLEN;
+		}
+	}
+	if (stealnext && (t = atomic_load(&victim->runnext)) &&
+	    atomic_cas(&victim->runnext, t, NULL))
+		return t;
+	return NULL;
+
+ STOLEN:
+	// keep the last one for running at once
+	n--;
+	t = q->ring[(tl + n) % RUNQ_SIZE];
+	if (n)
+		atomic_store(&q->tail, tl + n);
+	return t;
+}
+
+// Move all the tasks of victim's run queue to the global queue, for a
+// victim stuck in a task. it may still put tasks meanwhile. returns the
+// number of tasks moved.
+static int runqdrain(struct thread *victim) {
+	struct task *grab[RUNQ_SIZE], *t;
+	struct list_head batch;
+	unsigned int h, tl, n, i, total = 0;
+	struct runq *vq;
+	int l;
+
+	if ((t = atomic_load(&victim->runnext)) && atomic_cas(&victim->runnext, t, NULL)) {
+		taskqueue_push(&taskqueue[atomic_load(&t->prio)], t);
+		total++;
+	}
+	for (l = 0; l < TASK_PRIO_LEVELS; l++) {
+		vq = &victim->runq[l];
+		for (;;) {
+			h = atomic_load(&vq->head);
+			tl = atomic_load(&vq->tail);
+			if ((n = tl - h) > RUNQ_SIZE)
+				continue;	// inconsistent head and tail
+			for (i = 0; i < n; i++)
+				grab[i] = vq->ring[(h + i) % RUNQ_SIZE];
+			if (atomic_cas(&vq->head, h, h + n))
+				break;
+		}
+		if (!n)
+			continue;
+		INIT_LIST_HEAD(&batch);
+		for (i = 0; i < n; i++)
+			list_add_tail(&grab[i]->alllink, &batch);
+		taskqueue_pushlist(&taskqueue[l], &batch, n);
+		total += n;
+	}
+	return total;
+}
+
+// Move a batch of tasks from a level of the global queue into the ring
+// of that level, no more than it has room for.
+static struct task *globrunqget(struct thread *thread) {
+	struct TaskQueue *tq;
+	struct task *t, *t1;
+	struct runq *q;
+	unsigned int tl;
+	int l, n, room, mask = 0;
+
+	for (l = 0; l < TASK_PRIO_LEVELS; l++)
+		if (atomic_load(&taskqueue[l].size))
+			mask |= 1 << l;
+	for (; mask; mask &= ~(1 << l)) {
+		l = prio_pick(thread->globage, mask);
+		tq = &taskqueue[l];
+		spin_lock(tq);
+		if (!(n = tq->size)) {
+			spin_unlock(tq);
+			continue;
+		}
+		n = n / atomic_load(&nthreads) + 1;
+		if (n > RUNQ_SIZE / 2)
+			n = RUNQ_SIZE / 2;
+		if (n > tq->size)
+			n = tq->size;
+		// only the thieves move the head meanwhile, it never shrinks
+		q = &thread->runq[l];
+		tl = q->tail;
+		room = RUNQ_SIZE - (tl - atomic_load(&q->head)) + 1;
+		if (n > room)
+			n = room;
+		tq->size -= n;
+		t = list_first(&tq->queue, struct task, alllink);
+		list_del(&t->alllink);
+		while (--n > 0) {
+			t1 = list_first(&tq->queue, struct task, alllink);
+			list_del(&t1->alllink);
+			q->ring[tl++ % RUNQ_SIZE] = t1;
+		}
+		atomic_store(&q->tail, tl);
+		spin_unlock(tq);
+		return t;
+	}
+	return NULL;
+}
+
+
+static inline void task_switch(struct context *from, struct context *to) {
+	context_switch(from, to);
+}
+
+
+static void task_leave(struct thread *thread, struct task *t);
+static void task_switchto(struct thread *thread, struct task *t, struct task *next);
+static void task_finish(struct thread *thread);
 
 static void task_exit(struct task *t) {
 	struct thread *thread;
+	struct task *r;
 
 	t->status = TASK_STOPPED;
 	if (!(thread = pthread_getspecific(thread_key)))
 		BUG_ON();
-	task_switch(&t->ucp, &thread->ucp);
+	// a coroutine returns to its resumer
+	if ((r = t->resumer)) {
+		t->resumer = NULL;
+		task_switchto(thread, t, r);
+	}
+	task_leave(thread, t);
 }
 
 static void task_start(void *arg) {
 	struct task *t = arg;
 
+	task_finish(pthread_getspecific(thread_key));
 	t->mainfunc(t->args);
 	task_exit(t);
 }
 
 
-static struct task *task_alloc(void (*mainfunc)(void *args), void *args, int stacksize) {
-	struct task *t;
+// Stopped tasks of the default stack size are cached on the thread
+// which ran them, up to TASK_CACHE_MAX. half of a full thread cache
+// goes to the global cache, which feeds the threads running short of
+// them and the spawns from outside of the scheduler. there is a global
+// cache per NUMA node, the stacks stay on the node they were touched.
+// a cached stack keeps its top TASK_CACHE_KEEP bytes, the pages below
+// are given back, so a burst of deep tasks doesn't pin the memory.
+#define TASK_CACHE_MAX 64
+#define TASK_CACHE_GLOBAL_MAX 4096
+#define TASK_CACHE_NODES 8
+#define TASK_CACHE_KEEP (8 * 1024)
 
-	t = malloc(sizeof(*t) + stacksize);
-	if (!t) {
-		fprintf(stderr, "coroutine alloc error\n");
-		return NULL;
+static struct TaskQueue taskcache[TASK_CACHE_NODES];
+
+static struct TaskQueue *task_cache_node(struct thread *thread) {
+	return &taskcache[thread && thread->node > 0 ? thread->node % TASK_CACHE_NODES : 0];
+}
+
+static void task_release(struct task *t) {
+	if (t->stackguard) {
+#ifdef VALGRIND
+		VALGRIND_STACK_DEREGISTER(t->stackid);
+#endif
+		sys_stack_free(t->stackguard, t->stacksize);
 	}
-	memset(t, 0, sizeof(*t));
-	memset(&t->ucp, 0, sizeof(t->ucp));
+	free(t);
+}
+
+static void task_cache_put(struct thread *thread, struct task *t) {
+	struct TaskQueue *tc = task_cache_node(thread);
+	struct list_head batch;
+	int n;
 
-	if (getcontext(&t->ucp) < 0) {
-		fprintf(stderr, "coroutine getcontext error\n");
-		free(t);
+	if (t->stackguard)
+		sys_stack_trim(t->stackguard, t->stacksize, TASK_CACHE_KEEP);
+	if (!thread) {
+		spin_lock(tc);
+		if (tc->size < TASK_CACHE_GLOBAL_MAX) {
+			list_add(&t->alllink, &tc->queue);
+			tc->size++;
+			t = NULL;
+		}
+		spin_unlock(tc);
+		if (t)
+			task_release(t);
+		return;
+	}
+	list_add(&t->alllink, &thread->taskcache);
+	if (++thread->ntaskcache <= TASK_CACHE_MAX)
+		return;
+
+	INIT_LIST_HEAD(&batch);
+	for (n = 0; n < TASK_CACHE_MAX / 2; n++)
+		list_move(thread->taskcache.prev, &batch);
+	thread->ntaskcache -= n;
+	spin_lock(tc);
+	if (tc->size < TASK_CACHE_GLOBAL_MAX) {
+		list_splice(&batch, &tc->queue);
+		tc->size += n;
+	}
+	spin_unlock(tc);
+	while (!list_empty(&batch)) {
+		t = list_first(&batch, struct task, alllink);
+		list_del(&t->alllink);
+		task_release(t);
+	}
+}
+
+static struct task *task_cache_get(struct thread *thread) {
+	struct TaskQueue *tc = task_cache_node(thread);
+	struct task *t;
+	int n;
+
+	if (thread && thread->ntaskcache) {
+		thread->ntaskcache--;
+		t = list_first(&thread->taskcache, struct task, alllink);
+		list_del(&t->alllink);
+		return t;
+	}
+	if (!atomic_load(&tc->size))
 		return NULL;
+	spin_lock(tc);
+	if (!tc->size) {
+		spin_unlock(tc);
+		return NULL;
+	}
+	t = list_first(&tc->queue, struct task, alllink);
+	list_del(&t->alllink);
+	tc->size--;
+	// refill the thread cache with a batch
+	for (n = 0; thread && n < TASK_CACHE_MAX / 2 && tc->size; n++) {
+		list_move(tc->queue.next, &thread->taskcache);
+		tc->size--;
+		thread->ntaskcache++;
 	}
+	spin_unlock(tc);
+	return t;
+}
 
-	t->tid = ++task_idgen;
-	t->mainfunc = mainfunc;
-	t->args = args;
+static struct task *task_alloc(struct thread *thread,
+			       void (*mainfunc)(void *args), void *args, int stacksize) {
+	struct task *t = NULL;
 
-	t->ucp.uc_stack.ss_sp = t->stackguard = (void *)(t + 1);
-	t->ucp.uc_stack.ss_size = t->stacksize = stacksize;
+	if (stacksize == TASK_STACK_DEFAULT)
+		t = task_cache_get(thread);
+	if (!t) {
+		t = malloc(sizeof(*t));
+		if (!t) {
+			fprintf(stderr, "coroutine alloc error\n");
+			return NULL;
+		}
+		memset(t, 0, sizeof(*t));
+		t->stacksize = stacksize;
+		// bound right away, so the spawner learns if they run out
+		if (!(t->stackguard = sys_stack_alloc(stacksize))) {
+			free(t);
+			errno = ENOMEM;
+			return NULL;
+		}
 #ifdef VALGRIND
-	VALGRIND_STACK_REGISTER(t->stackguard, t->stackguard + t->stacksize);
+		t->stackid = VALGRIND_STACK_REGISTER(t->stackguard,
+						     t->stackguard + t->stacksize);
 #endif
-	makecontext(&t->ucp, (void (*)())task_start, 1, t);
+	}
 
+	atomic_add(&sched.ntasks, 1);
+	t->coroutine = 0;
+	t->resumer = NULL;
+	t->group = NULL;
+	t->deadline = -1;
+	t->prio = TASK_PRIO_NORMAL;
+	t->status = TASK_CREATED;
+	t->tid = atomic_add(&task_idgen, 1);
+	t->mainfunc = mainfunc;
+	t->args = args;
 	return t;
 }
 
-static void task_free(struct task *t) {
-	free(t);
+static void task_free(struct thread *thread, struct task *t) {
+	if (t->stacksize == TASK_STACK_DEFAULT)
+		task_cache_put(thread, t);
+	else
+		task_release(t);
+}
+
+// Prepare the first frame of a new task on its stack.
+static int task_prepare(struct task *t) {
+	if (context_init(&t->ctx, t->stackguard, t->stacksize, task_start, t) < 0) {
+		fprintf(stderr, "coroutine context_init error\n");
+		return -1;
+	}
+	return 0;
 }
 
 
-int task_create(void (*mainfunc)(void *arg), void *arg, int stacksize) {
-	struct task *t = task_alloc(mainfunc,
-				    arg, stacksize == 0 ? TASK_STACK_DEFAULT : stacksize);
+struct task *task_current(void) {
+	struct thread *thread = pthread_getspecific(thread_key);
+
+	return thread ? thread->task0 : NULL;
+}
+
+void task_park(int (*commit)(struct task *t, void *arg), void *arg) {
+	struct task *t;
+	struct thread *thread;
+
+	if (!(thread = pthread_getspecific(thread_key)) || !(t = thread->task0))
+		BUG_ON();
+	thread->parkcommit = commit;
+	thread->parkarg = arg;
+	t->status = TASK_PARKED;
+	task_leave(thread, t);
+}
+
+void task_ready(struct task *t) {
+	struct thread *thread = pthread_getspecific(thread_key);
+
+	t->status = TASK_WAITING;
+	if (thread)
+		runqput(thread, t, thread->task0 != NULL);
+	else
+		taskqueue_push(&taskqueue[atomic_load(&t->prio)], t);
+	wakep();
+}
+
+int waiter_claim(struct waiter *w) {
+	struct selectwait *sel = w->sel;
+	int state;
+
+	if (!sel)
+		return 1;
+	for (;;) {
+		state = atomic_load(&sel->state);
+		if (state == SEL_REGISTERING &&
+		    atomic_cas(&sel->state, state, SEL_FIRED_EARLY)) {
+			sel->fired = w->index;
+			return 2;
+		}
+		if (state == SEL_PARKED &&
+		    atomic_cas(&sel->state, state, SEL_FIRED)) {
+			sel->fired = w->index;
+			return 1;
+		}
+		if (state == SEL_FIRED || state == SEL_FIRED_EARLY)
+			return 0;
+	}
+}
+
+static void task_joinable(struct task *t, void *(*spawnfunc)(void *arg)) {
+	t->spawnfunc = spawnfunc;
+	t->result = NULL;
+	t->joiner = NULL;
+	t->joinstate = spawnfunc ? TASK_JOIN_RUNNING : TASK_JOIN_NONE;
+}
+
+static void task_spawn_main(void *arg);
+
+// t inherits the deadline and the priority of the task spawning it,
+// and joins g or the group of that task if g is NULL.
+static void task_inherit(struct thread *thread, struct task *t, struct task_group *g) {
+	if (thread && thread->task0) {
+		t->deadline = thread->task0->deadline;
+		t->prio = atomic_load(&thread->task0->prio);
+		if (!g)
+			g = thread->task0->group;
+	}
+	if ((t->group = g))
+		group_join(g);
+}
+
+static struct task *task_new(void (*mainfunc)(void *arg), void *arg, int stacksize,
+			     void *(*spawnfunc)(void *arg), struct task_group *g,
+			     int prio) {
+	struct thread *thread = pthread_getspecific(thread_key);
+	struct task *t = task_alloc(thread, mainfunc, arg,
+				    sys_stack_size(stacksize == 0 ? TASK_STACK_DEFAULT : stacksize));
 
 	if (!t)
+		return NULL;
+	task_joinable(t, spawnfunc);
+	task_inherit(thread, t, g);
+	if (prio >= 0)
+		t->prio = prio;
+	// spawned by a running task, keep it on the local run queue,
+	// otherwise inject it into the global queue.
+	if (thread && thread->task0)
+		runqput(thread, t, 1);
+	else
+		taskqueue_push(&taskqueue[t->prio], t);
+	wakep();
+	task_safepoint();
+	return t;
+}
+
+int task_create(void (*mainfunc)(void *arg), void *arg, int stacksize) {
+	return task_new(mainfunc, arg, stacksize, NULL, NULL, -1) ? 0 : -1;
+}
+
+int task_create_prio(void (*mainfunc)(void *arg), void *arg, int stacksize, int prio) {
+	if (prio < 0 || prio >= TASK_PRIO_LEVELS) {
+		errno = EINVAL;
+		return -1;
+	}
+	return task_new(mainfunc, arg, stacksize, NULL, NULL, prio) ? 0 : -1;
+}
+
+int task_setpriority(task_t *t, int prio) {
+	if (!t && !(t = task_current())) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (prio < 0 || prio >= TASK_PRIO_LEVELS) {
+		errno = EINVAL;
 		return -1;
-	return taskqueue_push(&taskqueue, t);
+	}
+	return atomic_xchg(&t->prio, prio);
+}
+
+int task_getpriority(task_t *t) {
+	if (!t && !(t = task_current()))
+		return TASK_PRIO_NORMAL;
+	return atomic_load(&t->prio);
+}
+
+int task_group_spawn(struct task_group *g, void (*mainfunc)(void *arg), void *arg,
+		     int stacksize) {
+	return task_new(mainfunc, arg, stacksize, NULL, g, -1) ? 0 : -1;
+}
+
+int task_create_batch(void (*const *funcs)(void *arg), void *const *args, int n,
+		      int stacksize) {
+	struct thread *thread = pthread_getspecific(thread_key);
+	struct list_head batch;
+	struct task *t;
+	int i;
+
+	if (n <= 0)
+		return 0;
+	stacksize = sys_stack_size(stacksize == 0 ? TASK_STACK_DEFAULT : stacksize);
+	INIT_LIST_HEAD(&batch);
+	for (i = 0; i < n; i++) {
+		if (!(t = task_alloc(thread, funcs[i], args ? args[i] : NULL, stacksize)))
+			break;
+		task_joinable(t, NULL);
+		task_inherit(thread, t, NULL);
+		list_add_tail(&t->alllink, &batch);
+	}
+	if (i == 0)
+		return -1;
+	if (thread && thread->task0)
+		runqputlist(thread, &batch, i);
+	else
+		taskqueue_pushlist(&taskqueue[list_first(&batch, struct task, alllink)->prio],
+				   &batch, i);
+	wakepn(i);
+	return i;
+}
+
+
+// Joinable tasks
+//
+// A spawned task stays around as a zombie once it stops, until it's
+// joined or detached. joinstate tells who frees it: the stopping task
+// itself if it's detached, otherwise the joiner.
+
+static void task_spawn_main(void *arg) {
+	struct task *t = task_current();
+
+	t->result = t->spawnfunc(arg);
+}
+
+task_t *task_spawn(void *(*func)(void *arg), void *arg, int stacksize) {
+	return task_new(task_spawn_main, arg, stacksize, func, NULL, -1);
+}
+
+// The scheduler is done with the stopped t. once a joiner may see it
+// stopped, t belongs to the joiner and mustn't be touched anymore.
+static void task_exited(struct thread *thread, struct task *t) {
+	int state, coroutine = t->coroutine;
+	struct task *joiner;
+
+	if (t->group && !coroutine)
+		group_leave(t->group);
+	for (;;) {
+		state = atomic_load(&t->joinstate);
+		if (state == TASK_JOIN_RUNNING &&
+		    atomic_cas(&t->joinstate, state, TASK_JOIN_EXITED))
+			break;
+		// the joiner finds it out when its park commit fails
+		if (state == TASK_JOIN_CLAIMED &&
+		    atomic_cas(&t->joinstate, state, TASK_JOIN_REAPED))
+			break;
+		if (state == TASK_JOIN_WAITING) {
+			joiner = t->joiner;
+			if (atomic_cas(&t->joinstate, state, TASK_JOIN_REAPED)) {
+				task_ready(joiner);
+				break;
+			}
+		}
+		if (state == TASK_JOIN_NONE || state == TASK_JOIN_DETACHED) {
+			task_free(thread, t);
+			break;
+		}
+	}
+	if (!coroutine)
+		task_stopped();
+}
+
+static int task_join_commit(struct task *self, void *arg) {
+	struct task *t = arg;
+
+	(void)self;
+	return atomic_cas(&t->joinstate, TASK_JOIN_CLAIMED, TASK_JOIN_WAITING);
+}
+
+// The joiner claims t by a cas first, a second joiner gets EINVAL.
+int task_join(task_t *t, void **result) {
+	int state;
+
+	for (;;) {
+		state = atomic_load(&t->joinstate);
+		if (state == TASK_JOIN_EXITED &&
+		    atomic_cas(&t->joinstate, state, TASK_JOIN_REAPED))
+			break;
+		if (state == TASK_JOIN_RUNNING &&
+		    atomic_cas(&t->joinstate, state, TASK_JOIN_CLAIMED)) {
+			t->joiner = task_current();
+			// runs again at once if t stopped meanwhile
+			task_park(task_join_commit, t);
+			if (atomic_load(&t->joinstate) != TASK_JOIN_REAPED)
+				BUG_ON();
+			break;
+		}
+		if (state != TASK_JOIN_RUNNING && state != TASK_JOIN_EXITED) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (result)
+		*result = t->result;
+	task_free(pthread_getspecific(thread_key), t);
+	return 0;
+}
+
+int task_detach(task_t *t) {
+	int state;
+
+	for (;;) {
+		state = atomic_load(&t->joinstate);
+		if (state == TASK_JOIN_RUNNING &&
+		    atomic_cas(&t->joinstate, state, TASK_JOIN_DETACHED))
+			return 0;
+		if (state == TASK_JOIN_EXITED &&
+		    atomic_cas(&t->joinstate, state, TASK_JOIN_REAPED)) {
+			task_free(pthread_getspecific(thread_key), t);
+			return 0;
+		}
+		if (state != TASK_JOIN_RUNNING && state != TASK_JOIN_EXITED) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
 }
 
 
@@ -277,15 +1351,299 @@ int task_yield(void) {
 		BUG_ON();
 	}
 	t = thread->task0;
-	thread->task0 = NULL;
 	t->status = TASK_WAITING;
-	
-	taskqueue_push(&taskqueue, t);
-	task_switch(&t->ucp, &thread->ucp);
 
+	// t goes back to the run queue after the switch, it must not be
+	// visible to the other threads before its context is saved.
+	task_leave(thread, t);
+
+	if (task_cancelled()) {
+		errno = ECANCELED;
+		return -1;
+	}
 	return 0;
 }
 
+// A preempted task goes to the tail of the global queue, behind all
+// the tasks waiting meanwhile.
+static int preempt_commit(struct task *t, void *arg) {
+	(void)arg;
+	t->status = TASK_WAITING;
+	taskqueue_push(&taskqueue[atomic_load(&t->prio)], t);
+	wakep();
+	return 1;
+}
+
+void task_safepoint(void) {
+	struct thread *thread = pthread_getspecific(thread_key);
+
+	if (thread && thread->preempt && thread->task0)
+		task_park(preempt_commit, NULL);
+}
+
+long long task_settimeslice(long long ns) {
+	return atomic_xchg(&timeslice, ns < 0 ? 0 : ns);
+}
+
+
+// Direct switch
+//
+// A task giving up its thread switches straight into the next task of
+// the local run queue, the scheduler context only comes in between when
+// the local run queue is empty, and once every 61 switches for the
+// global queue, the timers and the network. the task switched away is
+// finished, requeued or committed to its park, by whoever runs next on
+// the thread once its context is saved.
+
+// Switch from the current task t to next, t->status tells what to do
+// with t.
+static void task_switchto(struct thread *thread, struct task *t, struct task *next) {
+	if (next->status == TASK_CREATED && task_prepare(next) < 0)
+		BUG_ON();
+	thread->prev = t;
+	thread->schedtick++;
+	thread->preempt = 0;
+	next->status = TASK_RUNNING;
+	thread->task0 = next;
+	task_switch(&t->ctx, &next->ctx);
+	task_finish(pthread_getspecific(thread_key));
+}
+
+static void task_leave(struct thread *thread, struct task *t) {
+	struct task *next;
+
+	if (thread->schedtick % 61 && (next = runqget(thread))) {
+		task_switchto(thread, t, next);
+		return;
+	}
+	thread->prev = t;
+	task_switch(&t->ctx, &thread->ctx);
+	task_finish(pthread_getspecific(thread_key));
+}
+
+// Finish the task switched away from on thread.
+static void task_finish(struct thread *thread) {
+	struct task *t = thread->prev;
+
+	if (!t)
+		return;
+	thread->prev = NULL;
+	if (t->status == TASK_STOPPED) {
+		task_exited(thread, t);
+	} else if (t->status == TASK_WAITING) {
+		runqput(thread, t, 0);
+	} else if (t->status == TASK_PARKED) {
+		// t may be running on another thread once committed
+		if (thread->parkcommit && !thread->parkcommit(t, thread->parkarg)) {
+			t->status = TASK_WAITING;
+			runqput(thread, t, 0);
+		}
+		thread->parkcommit = NULL;
+	}
+}
+
+
+// Coroutines
+//
+// A coroutine is a joinable task which only runs when it's resumed, the
+// resumer parks and switches straight into it, and task_suspend or the
+// return of the coroutine switches straight back. the resumer stands for
+// the coroutine as a live task.
+
+task_t *task_coroutine(void *(*func)(void *arg), void *arg, int stacksize) {
+	struct thread *thread = pthread_getspecific(thread_key);
+	struct task *t = task_alloc(thread, task_spawn_main, arg,
+				    sys_stack_size(stacksize == 0 ? TASK_STACK_DEFAULT : stacksize));
+
+	if (!t)
+		return NULL;
+	task_joinable(t, func);
+	t->coroutine = 1;
+	// shares the group of its creator, a cancel reaches it too
+	if (thread && thread->task0) {
+		t->group = thread->task0->group;
+		t->deadline = thread->task0->deadline;
+		t->prio = atomic_load(&thread->task0->prio);
+	}
+	atomic_sub(&sched.ntasks, 1);
+	return t;
+}
+
+int task_resume(task_t *t, void **value) {
+	struct thread *thread = pthread_getspecific(thread_key);
+	struct task *self;
+
+	if (!thread || !(self = thread->task0) || !t->coroutine || t->resumer ||
+	    atomic_load(&t->joinstate) != TASK_JOIN_RUNNING) {
+		errno = EINVAL;
+		return -1;
+	}
+	t->resumer = self;
+	self->status = TASK_PARKED;
+	thread->parkcommit = NULL;
+	task_switchto(thread, self, t);
+
+	// back from task_suspend, or t returned
+	if (atomic_load(&t->joinstate) == TASK_JOIN_EXITED) {
+		task_join(t, value);
+		return 1;
+	}
+	if (value)
+		*value = t->result;
+	return 0;
+}
+
+int task_suspend(void *value) {
+	struct thread *thread = pthread_getspecific(thread_key);
+	struct task *t, *r;
+
+	if (!thread || !(t = thread->task0) || !(r = t->resumer)) {
+		errno = EINVAL;
+		return -1;
+	}
+	t->result = value;
+	t->resumer = NULL;
+	t->status = TASK_PARKED;
+	thread->parkcommit = NULL;
+	task_switchto(thread, t, r);
+	return 0;
+}
+
+
+// Find a runnable task for thread: the local run queue, the global
+// queue, and then steal from the other threads.
+static struct task *findrunnable(struct thread *thread) {
+	struct task *t;
+	struct thread *victim;
+	long long now = 0;
+	int i, k, n, off;
+
+	// the expired timers make their tasks runnable
+	if (timers_next(&thread->timers) >= 0)
+		thread_timers_run(thread, now = nanotime());
+
+	// poll the network once in a while too, the ready tasks go to the
+	// local run queue instead of waiting for the whole backlog.
+	if (thread->schedtick % 61 == 0 && netpoll_inuse())
+		netpoll(0);
+
+	// check the global queue once in a while for fairness, otherwise
+	// two tasks yield to each other may starve the global queue. take
+	// a batch, so a long global queue doesn't drain one task at a time.
+	if (thread->schedtick % 61 == 0 && (t = globrunqget(thread)))
+		return t;
+	if ((t = runqget(thread)))
+		return t;
+	if ((t = globrunqget(thread)))
+		return t;
+
+	// steal half of the run queue of a random victim, the victims on
+	// the same NUMA node first.
+	for (i = 0; i < 4; i++) {
+		n = atomic_load(&nthreads);
+		off = fastrand(thread) % n;
+		for (k = 0; k < (affinity > 0 ? 2 * n : n); k++) {
+			victim = atomic_load(&allthreads[(off + k) % n]);
+			if (!victim || victim == thread ||
+			    (atomic_load(&victim->node) == thread->node) != (k < n))
+				continue;
+			if ((t = runqsteal(thread, victim, i == 3)))
+				return t;
+			// the victim is busy, run its timers on its behalf
+			if (i == 3 && timers_next(&victim->timers) >= 0) {
+				if (!now)
+					now = nanotime();
+				if (thread_timers_run(victim, now) && (t = runqget(thread)))
+					return t;
+			}
+		}
+	}
+	if ((t = globrunqget(thread)))
+		return t;
+	if (netpoll_inuse() && netpoll(0) && (t = runqget(thread)))
+		return t;
+	return NULL;
+}
+
+
+// Stop spinning, if it was the last spinning thread, wake up another
+// one for the rest of the work.
+static void thread_stopspinning(struct thread *thread) {
+	if (!thread->spinning)
+		return;
+	thread->spinning = 0;
+	if (!atomic_sub(&sched.nspinning, 1))
+		wakep();
+}
+
+// Spin for a while and then park until there is work, return NULL
+// when the runtime shuts down.
+static struct task *thread_idle(struct thread *thread) {
+	struct task *t = NULL;
+	long long next;
+	int i;
+
+	for (;;) {
+		if (!thread->spinning) {
+			thread->spinning = 1;
+			atomic_add(&sched.nspinning, 1);
+		}
+		for (i = 0; i < SPIN_ROUNDS; i++) {
+			if (atomic_load(&sched.shutdown))
+				return NULL;
+			if ((t = findrunnable(thread)))
+				return t;
+			cpu_relax();
+		}
+
+		// one thread too many since a blocked one came back
+		if (thread_retire(thread)) {
+			thread_stopspinning(thread);
+			thread_park(thread);
+			continue;
+		}
+
+		// one of the idle threads blocks in netpoll instead of
+		// the futex, under the same protocol as idle_put.
+		if ((netpoll_inuse() || timers_nearest() >= 0) &&
+		    atomic_cas(&sched.netpolling, 0, 1)) {
+			thread->spinning = 0;
+			atomic_sub(&sched.nspinning, 1);
+			if (!atomic_load(&sched.shutdown) && !(t = findrunnable(thread))) {
+				// sleep until the nearest timer
+				if ((next = timers_nearest()) >= 0 && (next -= nanotime()) < 0)
+					next = 0;
+				netpoll(next);
+				timers_runall(nanotime());
+			}
+			atomic_store(&sched.netpolling, 0);
+			if (t || (t = runqget(thread))) {
+				// somebody else takes over the poller
+				if (netpoll_inuse() || timers_nearest() >= 0)
+					wakep();
+				return t;
+			}
+			continue;
+		}
+
+		// publish ourself as idle and look at the queues once more,
+		// the producer pushes the work and then looks for the idle
+		// threads, one of them must see the other. wakep may set
+		// spinning once we are on the idle list.
+		thread->spinning = 0;
+		atomic_sub(&sched.nspinning, 1);
+		idle_put(thread);
+		if (!atomic_load(&sched.shutdown) && !(t = findrunnable(thread))) {
+			thread_park(thread);
+			continue;
+		}
+		if (!idle_del(thread))
+			thread_park(thread);	// consume the wakeup
+		if (t)
+			return t;
+	}
+}
+
 
 static void task_schedule(void) {
 	struct task *t;
@@ -295,23 +1653,228 @@ static void task_schedule(void) {
 		BUG_ON();
 
 	for (;;) {
-		t = taskqueue_pop(&taskqueue);
-		if (!t) {
-			fprintf(stderr, "no runnable tasks!\n");
+		if (!(t = findrunnable(thread)) && !(t = thread_idle(thread)))
 			return;
-		}
+		thread_stopspinning(thread);
 #ifdef DEBUG
 		fprintf(stdout, "runnning task: %lu %d\n", thread->pid, t->tid);
 #endif
+		if (t->status == TASK_CREATED && task_prepare(t) < 0)
+			BUG_ON();
+		thread->schedtick++;
+		thread->preempt = 0;
 		t->status = TASK_RUNNING;
 		thread->task0 = t;
-		task_switch(&thread->ucp, &t->ucp);
+		task_switch(&thread->ctx, &t->ctx);
+		thread->task0 = NULL;
+
+		// back in scheduler, maybe from another task than t
+		task_finish(thread);
+	}
+}
+
+// A task running off its stack faults on the guard page, the fault is
+// reported on the signal stack of the thread and then delivered again
+// with the default action.
+#define SIGSTACK_SIZE (64 * 1024)
 
-		// back in scheduler
-		if (t->status == TASK_STOPPED) {
-			task_free(t);
+static void stack_overflow_handler(int sig, siginfo_t *si, void *uc) {
+	static const char msg[] = "coroutine stack overflow\n";
+	struct thread *thread = pthread_getspecific(thread_key);
+	struct task *t;
+	ssize_t n;
+
+	(void)uc;
+	if (thread && (t = thread->task0) && t->stackguard &&
+	    sys_stack_guarded(t->stackguard, si->si_addr)) {
+		// nothing to do about a failed write here
+		n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+		(void)n;
+	}
+	signal(sig, SIG_DFL);
+}
+
+static void thread_sigstack_init(struct thread *thread) {
+	stack_t ss;
+
+	if (!(thread->sigstack = malloc(SIGSTACK_SIZE)))
+		return;
+	ss.ss_sp = thread->sigstack;
+	ss.ss_size = SIGSTACK_SIZE;
+	ss.ss_flags = 0;
+	if (sigaltstack(&ss, NULL) < 0) {
+		free(thread->sigstack);
+		thread->sigstack = NULL;
+	}
+}
+
+static void stack_overflow_init(void) {
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = stack_overflow_handler;
+	sa.sa_flags = SA_SIGINFO|SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+// The monitor thread. a task holding its thread for a time slice is
+// asked to give it up by SIGURG. the handler raises the preempt flag of
+// the thread, and if the task was interrupted in its own code, makes it
+// call task_safepoint right away with context_preempt: a loop without
+// any call is preempted too. the task interrupted in the runtime or in
+// libc may hold a lock, it is stopped at its next safe point instead. a
+// thread stuck in the kernel gets a spare thread. the monitor naps
+// longer while nothing is running. once a second it gives back the
+// pages of the stacks left idle in their pools since the last time.
+#define SYSMON_MIN_NS 1000000LL
+#define SYSMON_MAX_NS 10000000LL
+#define SYSMON_SCAVENGE_NS 1000000000LL
+
+static unsigned int sysmon_wait;
+
+// the text of the program from _start on, the PLT before it is how the
+// runtime calls libc too. the runtime is in gogo_text, see Makefile.
+extern char _start[], etext[];
+extern char __start_gogo_text[] __attribute__((weak));
+extern char __stop_gogo_text[] __attribute__((weak));
+
+static int preempt_enabled;
+
+static int preempt_tasktext(char *pc) {
+	return pc >= _start && pc < etext &&
+		!(pc >= __start_gogo_text && pc < __stop_gogo_text);
+}
+
+static int preempt_async(char *pc) {
+	return preempt_enabled && preempt_tasktext(pc);
+}
+
+// a libc linked in statically would be taken for task code, a task
+// stopped in malloc or stdio would park with their lock held.
+static int preempt_async_init(void) {
+	if (!__start_gogo_text || context_preempt_init() < 0)
+		return 0;
+	return !preempt_tasktext((char *)malloc) && !preempt_tasktext((char *)fwrite) &&
+		!preempt_tasktext((char *)pthread_mutex_lock);
+}
+
+int task_async_preempt(void) {
+	return atomic_load(&preempt_enabled);
+}
+
+static void preempt_handler(int sig, siginfo_t *si, void *uc) {
+	struct thread *thread = pthread_getspecific(thread_key);
+
+	(void)sig;
+	(void)si;
+	// the task which ran too long may have gone meanwhile
+	if (!thread || !thread->task0 || thread->schedtick != atomic_load(&thread->preempttick))
+		return;
+	thread->preempt = 1;
+	if (preempt_async(context_pc(uc)))
+		context_preempt(uc, task_safepoint);
+}
+
+static void preempt_init(void) {
+	struct sigaction sa;
+
+	atomic_store(&preempt_enabled, preempt_async_init());
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = preempt_handler;
+	sa.sa_flags = SA_SIGINFO|SA_RESTART|SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGURG, &sa, NULL);
+}
+
+// A thread in the same task for a time slice is either busy or stuck
+// in the kernel by a call we don't wrap. the busy one is preempted, a
+// spare thread runs in place of the stuck one until it comes back, the
+// signal would only interrupt its syscall. the run queue and the timers
+// of the stuck one are taken over by us.
+static void sysmon_check(struct thread *thread, long long now, long long slice) {
+	unsigned int tick = atomic_load(&thread->schedtick);
+
+	if (tick != thread->sysmontick || !atomic_load(&thread->task0)) {
+		thread->sysmontick = tick;
+		thread->sysmonwhen = now;
+		if (thread->blocked) {
+			thread->blocked = 0;
+			atomic_sub(&sched.nblocked, 1);
 		}
+		return;
+	}
+	if (thread->blocked) {
+		// the stuck thread can't serve its queue and its timers,
+		// the threads busy with their own tasks may not steal them.
+		if (runqdrain(thread))
+			wakep();
+		thread_timers_run(thread, now);
+		return;
 	}
+	if (now - thread->sysmonwhen < (slice > 0 ? slice : TASK_SLICE_NS))
+		return;
+	thread->sysmonwhen = now;
+	if (sys_thread_blocked(thread->ktid)) {
+		thread->blocked = 1;
+		atomic_add(&sched.nblocked, 1);
+		runqdrain(thread);
+		thread_handoff();
+	} else if (slice > 0) {
+		atomic_store(&thread->preempttick, tick);
+		pthread_kill(thread->pid, SIGURG);
+	}
+}
+
+static void *sysmon(void *arg) {
+	struct thread *thread;
+	long long now, delay = SYSMON_MIN_NS, scavenged = 0;
+	int i, n, busy;
+
+	(void)arg;
+	sys_thread_unbind();
+	while (!atomic_load(&sched.shutdown)) {
+		futexsleep(&sysmon_wait, 0, delay);
+		busy = 0;
+		now = nanotime();
+		n = atomic_load(&nthreads);
+		for (i = 0; i < n; i++) {
+			if (!(thread = atomic_load(&allthreads[i])))
+				continue;
+			if (atomic_load(&thread->task0))
+				busy = 1;
+			sysmon_check(thread, now, atomic_load(&timeslice));
+		}
+		if (now - scavenged >= SYSMON_SCAVENGE_NS) {
+			sys_stack_scavenge();
+			scavenged = now;
+		}
+		if (busy)
+			delay = SYSMON_MIN_NS;
+		else if ((delay *= 2) > SYSMON_MAX_NS)
+			delay = SYSMON_MAX_NS;
+	}
+	return NULL;
+}
+
+static pthread_t sysmon_pid;
+static int sysmon_running;
+
+static void sysmon_start(void) {
+	preempt_init();
+	if (pthread_create(&sysmon_pid, NULL, sysmon, NULL) == 0)
+		sysmon_running = 1;
+}
+
+// Wait for the monitor to leave after the shutdown, it looks at all the
+// threads and must be gone before they are freed.
+static void sysmon_stop(void) {
+	if (!sysmon_running)
+		return;
+	atomic_store(&sysmon_wait, 1);
+	futexwakeup(&sysmon_wait, 1);
+	pthread_join(sysmon_pid, NULL);
+	sysmon_running = 0;
 }
 
 static void thread_start(void *args) {
@@ -319,6 +1882,9 @@ static void thread_start(void *args) {
 
 	fprintf(stdout, "thread %lu start\n", thread->pid);
 	pthread_setspecific(thread_key, thread);
+	thread->ktid = sys_gettid();
+	thread_bind(thread);
+	thread_sigstack_init(thread);
 	task_schedule();
 	fprintf(stdout, "thread %lu exit\n", thread->pid);
 	pthread_exit(NULL);
@@ -326,20 +1892,34 @@ static void thread_start(void *args) {
 }
 
 
+static void *mheap_sysalloc(int size) {
+	return malloc(size);
+}
+
 int main(int argc, char **argv) {
 
-	int ret;
+	int i, ret;
 	void *status;
-	struct thread *thread;
+	struct thread *thread, *thread0;
 	struct task_args args = {argc, argv};
 
 
 	// initial the global taskqueue and threadqueue
-	taskqueue_init(&taskqueue);
+	for (i = 0; i < TASK_PRIO_LEVELS; i++)
+		taskqueue_init(&taskqueue[i]);
+	for (i = 0; i < TASK_CACHE_NODES; i++)
+		taskqueue_init(&taskcache[i]);
 	threadqueue_init(&threadqueue);
+	spinlock_init(&sched);
+	INIT_LIST_HEAD(&sched.idle);
+	INIT_LIST_HEAD(&sched.spare);
 
 	// initialized mheap
-	mheap_init();
+	mheap_init(&runtime_mheap, mheap_sysalloc, free);
+	sys_stack_init();
+
+	// the tasks fall back to yield if there is no netpoll
+	netpoll_init();
 	
 	if ((ret = pthread_key_create(&thread_key, NULL)) != 0) {
 		fprintf(stderr, "pthread_key_create failed\n");
@@ -348,23 +1928,33 @@ int main(int argc, char **argv) {
 
 	// Warning! must create the first task for task_main function
 	// before startup the other threads.
-	if ((ret = task_create((void (*)())task_main, &args, 8096)) != 0) {
+	if ((ret = task_create((void (*)())task_main, &args, TASK_STACK_DEFAULT)) != 0) {
 		fprintf(stderr, "mainfunc_task_create failed\n");
 		exit(1);
 	}
 
+	// init the mock pthread environment for current process, it
+	// must be registered before the other threads start stealing.
+	thread0 = thread_alloc(thread_start, NULL);
+	thread0->pid = pthread_self();
+	thread0->ktid = sys_gettid();
+	pthread_setspecific(thread_key, thread0);
+	thread_sigstack_init(thread0);
+	stack_overflow_init();
+
 	// here, fine!
 	// is ok to start up more backend threads to process the task
-	thread_create(thread_start, NULL, PTHREAD_STACK_MIN);
-
-	// init the mock pthread environment for current process
-	// take participate in the task_schedule and then free the
-	// mock data if done.
-	thread = thread_alloc(thread_start, NULL);
-	pthread_setspecific(thread_key, thread);
+	maxprocs = maxprocs_init();
+	affinity = affinity_init();
+	atomic_store(&procstarted, 1);
+	// before the other threads start, they inherit its cpu meanwhile
+	thread_bind(thread0);
+	procs_grow(maxprocs);
+	sysmon_start();
+
+	// take participate in the task_schedule
 	task_schedule();
-	thread_free(thread);
-
+	sysmon_stop();
 
 	// wait for all other threads exit
 	for (;;) {
@@ -376,9 +1966,11 @@ int main(int argc, char **argv) {
 		pthread_join(thread->pid, &status);
 		thread_free(thread);
 	}
+	thread_free(thread0);
 
 	pthread_exit(NULL);
-	taskqueue_exit(&taskqueue);
+	for (i = 0; i < TASK_PRIO_LEVELS; i++)
+		taskqueue_exit(&taskqueue[i]);
 	threadqueue_exit(&threadqueue);
 	
 	return 0;
@@ -5,13 +5,29 @@
 #define _TASK_H_
 
 #include "list.h"
+#include "context.h"
 #include <unistd.h>
 #include <sys/types.h>
-#include <ucontext.h>
 
+#define TASK_CREATED 0x0000
 #define TASK_RUNNING 0x0001
 #define TASK_STOPPED 0x0002
 #define TASK_WAITING 0x0004
+#define TASK_PARKED  0x0008
+
+#define TASK_JOIN_NONE 0	// task_create, freed when it stops
+#define TASK_JOIN_RUNNING 1
+#define TASK_JOIN_WAITING 2	// joiner parked
+#define TASK_JOIN_EXITED 3	// zombie until joined
+#define TASK_JOIN_DETACHED 4
+#define TASK_JOIN_CLAIMED 5	// joiner on its way to park
+#define TASK_JOIN_REAPED 6	// stopped, the joiner or detacher frees it
+
+// Priority levels, the lower runs first
+#define TASK_PRIO_HIGH 0
+#define TASK_PRIO_NORMAL 1
+#define TASK_PRIO_LOW 2
+#define TASK_PRIO_LEVELS 3
 
 struct task_args {
 	int c;
@@ -21,23 +37,132 @@ struct task_args {
 typedef struct task {
 	int status;
 	int tid;
-	ucontext_t ucp;
+	struct context ctx;
 	void (*mainfunc)(void *args);
 	void *args;
-	void *stackguard;
+	void *stackguard;	// lowest usable address, guard page below
 	int stacksize;
+	unsigned int stackid;	// valgrind stack id
+	void *(*spawnfunc)(void *args);
+	void *result;		// of spawnfunc
+	int joinstate;
+	struct task *joiner;
+	int coroutine;
+	struct task *resumer;	// of a running coroutine
+	struct task_group *group;	// NULL if none
+	long long deadline;	// nanotime, -1 if none
+	int prio;		// TASK_PRIO_*
 	//LIST_ENTRY(task) alllink;
 	struct list_head alllink;    // on all coroutine
 } task_t;
 
 #define BUG_ON(x...) abort()
 
-#define TASK_STACK_DEFAULT 8192
+// Stacks are reserved with mmap and committed page by page when they
+// are touched, so a task only costs the pages it really uses. they are
+// carved out of large mappings, the number of tasks isn't bound by
+// vm.max_map_count.
+#define TASK_STACK_DEFAULT (256 * 1024)
 
+// Returns -1 with errno ENOMEM if the task or its stack can't be had.
 int task_create(void (*mainfunc)(void *args), void *args, int stacksize);
+// Create n tasks running funcs[i](args[i]) at once, they are queued with
+// one queue operation and wake up to n idle threads. args may be NULL.
+// returns the number of tasks created, -1 if none.
+int task_create_batch(void (*const *funcs)(void *args), void *const *args, int n,
+		      int stacksize);
+// Create a task at priority prio, the others get the priority of the
+// task spawning them, TASK_PRIO_NORMAL outside of the tasks. returns -1
+// with errno EINVAL if prio is not a TASK_PRIO_* level.
+int task_create_prio(void (*mainfunc)(void *args), void *args, int stacksize, int prio);
+// Set the priority of t, the current task if NULL, it applies from the
+// next time t is queued. returns the old one, or -1 with errno EINVAL.
+int task_setpriority(task_t *t, int prio);
+int task_getpriority(task_t *t);
+// Spawn a joinable task, the task struct lives on until it's joined or
+// detached. returns NULL with errno ENOMEM on failure.
+task_t *task_spawn(void *(*func)(void *args), void *args, int stacksize);
+// Park until t stops, then collect its return value into *result and
+// free t. returns -1 with errno EINVAL if t is detached or being joined,
+// a task is joined by one task at most.
+int task_join(task_t *t, void **result);
+// Let t free itself once it stops, it can't be joined anymore.
+int task_detach(task_t *t);
+
+// Create a coroutine, a task which only runs when it's resumed. it must
+// be resumed until it returns, it's freed then.
+task_t *task_coroutine(void *(*func)(void *args), void *args, int stacksize);
+// Run t until it suspends, return 0 with the value it suspended with in
+// *value, or 1 with its return value once it returned.
+int task_resume(task_t *t, void **value);
+// Switch back to the resumer of the current coroutine.
+int task_suspend(void *value);
+// Returns -1 with errno ECANCELED if the group of the task is cancelled.
 int task_yield(void);
+// Run fn(arg) on a thread of the blocking pool and park until it
+// returns, for the calls that block the thread whatever we do. errno
+// is carried back to the task. returns what fn returned.
+void *task_blocking(void *(*fn)(void *arg), void *arg);
+// A safe point, the task gives up the thread here if it has run out of
+// its time slice. the channel operations, the I/O wrappers and spawning
+// are safe points too. if task_async_preempt(), a task in its own code
+// is stopped wherever it is, otherwise long loops without any of them
+// should call it.
+void task_safepoint(void);
+// 1 on amd64 but for the UCONTEXT build, unless libc is linked in
+// statically: the task code can't be told apart from libc then.
+int task_async_preempt(void);
+// Set the time slice in nanoseconds, 10ms by default, 0 turns the
+// preemption off. returns the old one.
+long long task_settimeslice(long long ns);
+
+// Task groups, see group.c. the tasks spawned by a member join its group
+// too, the coroutines share it without being members.
+struct task_group *task_group_make(void);
+// Free g, it must have no members left.
+void task_group_free(struct task_group *g);
+// Create a task in g like task_create.
+int task_group_spawn(struct task_group *g, void (*mainfunc)(void *args), void *args,
+		     int stacksize);
+// Park until all the members of g stopped.
+int task_group_wait(struct task_group *g);
+// Cancel g, the waits of its members fail with ECANCELED from now on:
+// task_yield, task_sleep, and the sys_* calls when they would have to
+// wait. the members parked on a descriptor are woken up at once.
+void task_group_cancel(struct task_group *g);
+// Whether the group of the current task is cancelled.
+int task_cancelled(void);
+
+// The monotonic clock in nanoseconds, the time base of the deadlines.
+long long task_now(void);
+// Park the current task for ns nanoseconds, or until the task_now()
+// deadline when, the thread runs the other tasks meanwhile. returns -1
+// with errno ECANCELED if the group of the task is cancelled, ENOMEM if
+// the timer can't be armed.
+int task_sleep(long long ns);
+int task_sleep_until(long long when);
+// Set the deadline of the current task, a task_now() time or -1 for
+// none, and return the old one. the tasks it spawns from now on inherit
+// it. once it passed, the sys_* calls which would have to wait fail
+// with ETIMEDOUT.
+long long task_setdeadline(long long when);
+// The deadline of the current task, -1 if none.
+long long task_deadline(void);
 int task_main(struct task_args *args);
 
+// Set the number of threads running tasks and return the previous
+// setting, n <= 0 only queries it. The default is the GOGOMAXPROCS
+// environment variable or the number of online cpus. Before task_main
+// starts (from a constructor, for example) any value is accepted, once
+// the runtime is running the setting can only be raised.
+int task_setmaxprocs(int n);
+// Bind each thread running tasks to a cpu if on > 0, the threads are
+// grouped by NUMA node and steal from their own node first. off by
+// default, or the GOGOAFFINITY environment variable. it can only be
+// set before task_main starts, on < 0 only queries it. returns the
+// previous setting, -1 with errno EBUSY once running.
+int task_setaffinity(int on);
+
 #define yield() task_yield()
 #define gogo(func, arg) do {\
 	task_create(func, arg, TASK_STACK_DEFAULT); \
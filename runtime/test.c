@@ -4,8 +4,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <time.h>
 #include "task.h"
 #include "malloc.h"
+#include "syscall_linux.h"
+#include "chan.h"
+#include "sync.h"
+#include "parallel.h"
 
 
 void test_main(void *args) {
@@ -95,7 +106,928 @@ void test_gogo(void *args) {
 	}
 	clock_gettime(CLOCK_REALTIME, &end);
 	ct = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
-	fprintf(stdout, "building %d thread cost: %lld\n", limit, ct);
+	fprintf(stdout, "building %d thread cost: %.0f\n", limit, ct);
+}
+
+void test_gogo_cached(void *args) {
+	int i, limit = 1000000;
+	double ct;
+	struct timespec start, end;
+
+	// yield once in a while, the stopped tasks come back from the
+	// task cache with their stacks.
+	clock_gettime(CLOCK_REALTIME, &start);
+	for (i = 0; i < limit; i++) {
+		gogo(test_gogo_foo, NULL);
+		if (i % 128 == 0)
+			yield();
+	}
+	clock_gettime(CLOCK_REALTIME, &end);
+	ct = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+	fprintf(stdout, "building %d cached thread cost: %.0f\n", limit, ct);
+}
+
+
+static char *test_deepstack_bottom;
+
+static int test_deepstack_foo(int depth) {
+	volatile char frame[1024];
+
+	frame[0] = depth;
+	if (depth == 0) {
+		test_deepstack_bottom = (char *)frame;
+		return frame[0];
+	}
+	return test_deepstack_foo(depth - 1) + frame[0];
+}
+
+void *test_deepstack_deep(void *args) {
+	return (void *)(long)test_deepstack_foo(120);
+}
+
+void test_deepstack(void *args) {
+	long pagesize = sysconf(_SC_PAGESIZE);
+	unsigned char vec;
+	task_t *t;
+
+	// ~120k of stack, far more than the committed pages of a new
+	// stack, less than the reserved size.
+	if (!(t = task_spawn(test_deepstack_deep, NULL, 0)) ||
+	    task_join(t, &args) < 0 || (long)args != (120 * 121) / 2)
+		BUG_ON();
+	// cached by the join, its deep pages are given back
+	if (mincore((void *)((long)test_deepstack_bottom & ~(pagesize - 1)), pagesize, &vec) < 0 ||
+	    (vec & 1))
+		BUG_ON();
+	fprintf(stdout, "test_deepstack ok\n");
+}
+
+static struct chan *test_manytasks_chan;
+static int test_manytasks_parked, test_manytasks_done;
+
+void test_manytasks_foo(void *args) {
+	long v;
+
+	__sync_add_and_fetch(&test_manytasks_parked, 1);
+	if (chan_recv(test_manytasks_chan, &v) == 0)
+		BUG_ON();
+	__sync_add_and_fetch(&test_manytasks_done, 1);
+}
+
+// More tasks alive at once than vm.max_map_count would allow with a
+// mapping and a guard of their own for each stack
+void test_manytasks(void *args) {
+	FILE *fp;
+	int i, n = 65530;
+
+	if ((fp = fopen("/proc/sys/vm/max_map_count", "r"))) {
+		if (fscanf(fp, "%d", &n) != 1)
+			n = 65530;
+		fclose(fp);
+	}
+	n = n / 2 + 1024;
+	if (n > 100000)
+		n = 100000;
+	if (!(test_manytasks_chan = chan_make(sizeof(long), 0)))
+		BUG_ON();
+	for (i = 0; i < n; i++)
+		if (task_create(test_manytasks_foo, NULL, 0) < 0)
+			BUG_ON();
+	while (__sync_fetch_and_add(&test_manytasks_parked, 0) != n)
+		task_sleep(1000000);
+	chan_close(test_manytasks_chan);
+	while (__sync_fetch_and_add(&test_manytasks_done, 0) != n)
+		task_sleep(1000000);
+	chan_free(test_manytasks_chan);
+	fprintf(stdout, "test_manytasks ok: %d\n", n);
+}
+
+static int test_steal_done;
+
+void test_steal_foo(void *args) {
+	int i;
+
+	for (i = 0; i < 10; i++)
+		yield();
+	__sync_add_and_fetch(&test_steal_done, 1);
+}
+
+void test_steal(void *args) {
+	int i, limit = 10000;
+
+	// more than a local run queue can hold, some of them overflow
+	// into the global queue and the others are stolen.
+	for (i = 0; i < limit; i++) {
+		gogo(test_steal_foo, NULL);
+	}
+	while (__sync_fetch_and_add(&test_steal_done, 0) != limit)
+		yield();
+	fprintf(stdout, "test_steal ok\n");
+}
+
+void test_maxprocs(void *args) {
+	int n = task_setmaxprocs(0);
+
+	if (n < 1)
+		BUG_ON();
+	// raise it by one, the new thread steals from the running ones
+	if (task_setmaxprocs(n + 1) != n || task_setmaxprocs(0) != n + 1)
+		BUG_ON();
+	fprintf(stdout, "test_maxprocs ok: %d\n", n + 1);
+}
+
+static int test_netpoll_fds[2];
+static int test_netpoll_wakeups;
+
+void test_netpoll_reader(void *args) {
+	char buf[16];
+	ssize_t n;
+
+	// parks on the netpoller until the writer wakes it up
+	n = sys_read(test_netpoll_fds[0], buf, sizeof(buf));
+	if (n != 5 || memcmp(buf, "hello", 5) != 0)
+		BUG_ON();
+	test_netpoll_wakeups++;
+	sys_close(test_netpoll_fds[0]);
+	sys_close(test_netpoll_fds[1]);
+	fprintf(stdout, "test_netpoll ok\n");
+}
+
+void test_netpoll_writer(void *args) {
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		yield();
+	if (test_netpoll_wakeups)
+		BUG_ON();
+	if (sys_write(test_netpoll_fds[1], "hello", 5) != 5)
+		BUG_ON();
+}
+
+void test_netpoll(void *args) {
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, test_netpoll_fds) < 0)
+		BUG_ON();
+	fcntl(test_netpoll_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(test_netpoll_fds[1], F_SETFL, O_NONBLOCK);
+	gogo(test_netpoll_reader, NULL);
+	gogo(test_netpoll_writer, NULL);
+}
+
+static int test_uring_fd = -1;
+static int test_uring_done;
+
+void test_uring_reader(void *args) {
+	long i = (long)args;
+	char buf[64], expect[64];
+
+	memset(expect, 'a' + i % 26, sizeof(expect));
+	if (sys_pread(test_uring_fd, buf, sizeof(buf), i * sizeof(buf)) != sizeof(buf))
+		BUG_ON();
+	if (memcmp(buf, expect, sizeof(buf)) != 0)
+		BUG_ON();
+	if (__sync_add_and_fetch(&test_uring_done, 1) == 100) {
+		sys_close(test_uring_fd);
+		fprintf(stdout, "test_uring ok\n");
+	}
+}
+
+void test_uring(void *args) {
+	char path[] = "/tmp/gogo_test_XXXXXX";
+	char buf[64];
+	long i;
+
+	if ((test_uring_fd = mkstemp(path)) < 0)
+		BUG_ON();
+	unlink(path);
+	for (i = 0; i < 100; i++) {
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		if (sys_write(test_uring_fd, buf, sizeof(buf)) != sizeof(buf))
+			BUG_ON();
+	}
+	// a hundred reads in flight on the rings
+	for (i = 0; i < 100; i++)
+		gogo(test_uring_reader, (void *)i);
+}
+
+static int test_poll_fds[2];
+
+static long long test_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void test_poll_writer(void *args) {
+	task_sleep(10000000);
+	if (sys_write(test_poll_fds[1], "x", 1) != 1)
+		BUG_ON();
+}
+
+void test_poll(void *args) {
+	struct pollfd pfd;
+	struct timeval tv;
+	long long start;
+	fd_set rfds;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, test_poll_fds) < 0)
+		BUG_ON();
+	// nothing to read, the task sleeps out the whole timeout
+	pfd.fd = test_poll_fds[0];
+	pfd.events = POLLIN;
+	start = test_now();
+	if (sys_poll(&pfd, 1, 50) != 0 || test_now() - start < 50000000LL)
+		BUG_ON();
+	// woken up by the writer long before the timeout
+	gogo(test_poll_writer, NULL);
+	FD_ZERO(&rfds);
+	FD_SET(test_poll_fds[0], &rfds);
+	tv.tv_sec = 10;
+	tv.tv_usec = 0;
+	if (sys_select(test_poll_fds[0] + 1, &rfds, NULL, NULL, &tv) != 1)
+		BUG_ON();
+	if (!FD_ISSET(test_poll_fds[0], &rfds) || test_now() - start > 5000000000LL)
+		BUG_ON();
+	sys_close(test_poll_fds[0]);
+	sys_close(test_poll_fds[1]);
+	fprintf(stdout, "test_poll ok\n");
+}
+
+static int test_sleep_done;
+
+void test_sleep_foo(void *args) {
+	long long ns = (long)args * 1000000LL, start = task_now();
+
+	task_sleep(ns);
+	if (task_now() - start < ns)
+		BUG_ON();
+	if (__sync_add_and_fetch(&test_sleep_done, 1) == 100)
+		fprintf(stdout, "test_sleep ok\n");
+}
+
+void test_sleep(void *args) {
+	long i;
+
+	// a hundred sleepers on the heaps of the threads at once
+	for (i = 0; i < 100; i++)
+		gogo(test_sleep_foo, (void *)(i % 10 * 5));
+}
+
+static struct chan *test_chan_unbuf, *test_chan_buf;
+
+void test_chan_producer(void *args) {
+	struct chan *c = args;
+	long i;
+
+	for (i = 1; i <= 1000; i++)
+		if (chan_send(c, &i) < 0)
+			BUG_ON();
+	chan_close(c);
+}
+
+void test_chan_consumer(void *args) {
+	static int done;
+	struct chan *c = args;
+	long i, sum = 0;
+
+	while (chan_recv(c, &i) == 0)
+		sum += i;
+	if (errno != EPIPE || i != 0 || sum != 500500)
+		BUG_ON();
+	if (chan_send(c, &i) == 0 || errno != EPIPE)
+		BUG_ON();
+	if (__sync_add_and_fetch(&done, 1) == 2) {
+		chan_free(test_chan_unbuf);
+		chan_free(test_chan_buf);
+		fprintf(stdout, "test_chan ok\n");
+	}
+}
+
+void test_chan(void *args) {
+	long i = 1;
+
+	if (!(test_chan_unbuf = chan_make(sizeof(long), 0)) ||
+	    !(test_chan_buf = chan_make(sizeof(long), 16)))
+		BUG_ON();
+	// nobody receiving, the unbuffered send can't complete
+	if (chan_trysend(test_chan_unbuf, &i) == 0 || errno != EAGAIN)
+		BUG_ON();
+	if (chan_tryrecv(test_chan_buf, &i) == 0 || errno != EAGAIN)
+		BUG_ON();
+	gogo(test_chan_consumer, test_chan_unbuf);
+	gogo(test_chan_producer, test_chan_unbuf);
+	gogo(test_chan_consumer, test_chan_buf);
+	gogo(test_chan_producer, test_chan_buf);
+}
+
+static struct chan *test_select_chans[4];
+static int test_select_fds[2];
+
+void test_select_producer(void *args) {
+	long i, k = (long)args;
+
+	for (i = 1; i <= 250; i++)
+		if (chan_send(test_select_chans[k], &i) < 0)
+			BUG_ON();
+}
+
+void test_select_writer(void *args) {
+	task_sleep(10000000LL);
+	if (sys_write(test_select_fds[1], "x", 1) != 1)
+		BUG_ON();
+}
+
+void test_select(void *args) {
+	struct select_case cases[5];
+	long i, k, v, sum = 0, vals[4];
+	int fdready = 0;
+	char c;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, test_select_fds) < 0)
+		BUG_ON();
+	fcntl(test_select_fds[0], F_SETFL, O_NONBLOCK);
+	for (k = 0; k < 4; k++) {
+		if (!(test_select_chans[k] = chan_make(sizeof(long), k)))
+			BUG_ON();
+		cases[k].op = SELECT_RECV;
+		cases[k].c = test_select_chans[k];
+		cases[k].elem = &vals[k];
+	}
+	cases[4].op = SELECT_READ;
+	cases[4].fd = test_select_fds[0];
+
+	// nothing ready, the timeout fires
+	if (task_select(cases, 5, 20000000LL) != -1 || errno != ETIMEDOUT)
+		BUG_ON();
+	for (k = 0; k < 4; k++)
+		gogo(test_select_producer, (void *)k);
+	gogo(test_select_writer, NULL);
+	// each select takes exactly one element
+	for (i = 0; i < 1001; i++) {
+		if ((k = task_select(cases, 5, -1)) < 0 || cases[k].err)
+			BUG_ON();
+		if (k < 4) {
+			sum += vals[k];
+			continue;
+		}
+		if (fdready++ || sys_read(test_select_fds[0], &c, 1) != 1)
+			BUG_ON();
+	}
+	if (sum != 4 * 31375 || !fdready)
+		BUG_ON();
+	for (k = 0; k < 4; k++) {
+		if (chan_tryrecv(test_select_chans[k], &v) == 0)
+			BUG_ON();
+		chan_free(test_select_chans[k]);
+	}
+	sys_close(test_select_fds[0]);
+	sys_close(test_select_fds[1]);
+	fprintf(stdout, "test_select ok\n");
+}
+
+static struct task_mutex test_sync_mutex;
+static struct task_cond test_sync_cond;
+static struct task_sema test_sync_sema;
+static struct task_waitgroup test_sync_wg;
+static int test_sync_counter, test_sync_inside, test_sync_ready;
+
+void test_sync_foo(void *args) {
+	int i, n;
+
+	// only 3 of them in here at once
+	task_sema_acquire(&test_sync_sema);
+	if ((n = __sync_add_and_fetch(&test_sync_inside, 1)) > 3)
+		BUG_ON();
+	for (i = 0; i < 100; i++) {
+		task_mutex_lock(&test_sync_mutex);
+		n = test_sync_counter;
+		yield();	// the others park on the mutex meanwhile
+		test_sync_counter = n + 1;
+		task_mutex_unlock(&test_sync_mutex);
+	}
+	__sync_sub_and_fetch(&test_sync_inside, 1);
+	task_sema_release(&test_sync_sema);
+
+	task_mutex_lock(&test_sync_mutex);
+	while (!test_sync_ready)
+		task_cond_wait(&test_sync_cond, &test_sync_mutex);
+	task_mutex_unlock(&test_sync_mutex);
+	task_waitgroup_done(&test_sync_wg);
+}
+
+void test_sync(void *args) {
+	int i;
+
+	task_mutex_init(&test_sync_mutex);
+	task_cond_init(&test_sync_cond);
+	task_sema_init(&test_sync_sema, 3);
+	task_waitgroup_init(&test_sync_wg);
+	task_waitgroup_add(&test_sync_wg, 20);
+	for (i = 0; i < 20; i++)
+		gogo(test_sync_foo, NULL);
+	task_sleep(1000000LL);
+	task_mutex_lock(&test_sync_mutex);
+	test_sync_ready = 1;
+	task_cond_broadcast(&test_sync_cond);
+	task_mutex_unlock(&test_sync_mutex);
+	task_waitgroup_wait(&test_sync_wg);
+	if (test_sync_counter != 20 * 100 || task_sema_tryacquire(&test_sync_sema) < 0)
+		BUG_ON();
+	fprintf(stdout, "test_sync ok\n");
+}
+
+void *test_join_foo(void *args) {
+	long n = (long)args;
+
+	if (n % 2)
+		yield();
+	return (void *)(n * n);
+}
+
+static task_t *test_join_target;
+static int test_join_won, test_join_lost;
+
+void *test_join_sleeper(void *args) {
+	task_sleep(20000000);
+	return args;
+}
+
+// Races the other joiner while the target sleeps, one of them wins
+void test_join_racer(void *args) {
+	void *result;
+
+	if (task_join(test_join_target, &result) == 0) {
+		if ((long)result != 42)
+			BUG_ON();
+		__sync_add_and_fetch(&test_join_won, 1);
+	} else if (errno == EINVAL) {
+		__sync_add_and_fetch(&test_join_lost, 1);
+	} else {
+		BUG_ON();
+	}
+}
+
+void test_join(void *args) {
+	task_t *handles[100];
+	void *result;
+	long i;
+
+	if (!(test_join_target = task_spawn(test_join_sleeper, (void *)42, 0)))
+		BUG_ON();
+	gogo(test_join_racer, NULL);
+	gogo(test_join_racer, NULL);
+	while (__sync_fetch_and_add(&test_join_won, 0) + __sync_fetch_and_add(&test_join_lost, 0) < 2)
+		task_sleep(1000000);
+	if (test_join_won != 1 || test_join_lost != 1)
+		BUG_ON();
+
+	for (i = 0; i < 100; i++)
+		if (!(handles[i] = task_spawn(test_join_foo, (void *)i, 0)))
+			BUG_ON();
+	// some of them are zombies already, the others park the joiner
+	for (i = 0; i < 100; i++) {
+		if (i % 10 == 9) {
+			if (task_detach(handles[i]) < 0)
+				BUG_ON();
+			continue;
+		}
+		if (task_join(handles[i], &result) < 0 || (long)result != i * i)
+			BUG_ON();
+	}
+	fprintf(stdout, "test_join ok\n");
+}
+
+void *test_coroutine_gen(void *args) {
+	long i, n = (long)args;
+	struct chan *c;
+
+	for (i = 0; i < n; i++) {
+		if (i == n / 2) {
+			// blocks as a normal task, the resumer keeps waiting
+			if (!(c = chan_make(sizeof(long), 1)) || chan_send(c, &i) < 0 ||
+			    chan_recv(c, &i) < 0)
+				BUG_ON();
+			chan_free(c);
+		}
+		task_suspend((void *)i);
+	}
+	return (void *)-1;
+}
+
+void test_coroutine(void *args) {
+	task_t *t;
+	void *v;
+	long i;
+
+	if (!(t = task_coroutine(test_coroutine_gen, (void *)100, 0)))
+		BUG_ON();
+	for (i = 0; i < 100; i++)
+		if (task_resume(t, &v) != 0 || (long)v != i)
+			BUG_ON();
+	if (task_resume(t, &v) != 1 || (long)v != -1)
+		BUG_ON();
+	fprintf(stdout, "test_coroutine ok\n");
+}
+
+static int test_runnext_stop;
+static long test_runnext_trips;
+
+void *test_runnext_ping(void *args) {
+	struct chan **c = args;
+	long n = 0;
+
+	while (!__sync_fetch_and_add(&test_runnext_stop, 0)) {
+		if (chan_send(c[0], &n) < 0 || chan_recv(c[1], &n) < 0)
+			BUG_ON();
+		n++;
+		__sync_add_and_fetch(&test_runnext_trips, 1);
+	}
+	chan_close(c[0]);
+	return (void *)n;
+}
+
+void *test_runnext_pong(void *args) {
+	struct chan **c = args;
+	long n;
+
+	while (chan_recv(c[0], &n) == 0)
+		if (chan_send(c[1], &n) < 0)
+			BUG_ON();
+	return NULL;
+}
+
+void test_runnext(void *args) {
+	struct chan *c[2];
+	task_t *ping, *pong;
+	void *n;
+
+	// the pair wakes each other through runnext, the time slice
+	// still lets us run to see them going and stop them.
+	if (!(c[0] = chan_make(sizeof(long), 0)) || !(c[1] = chan_make(sizeof(long), 1)))
+		BUG_ON();
+	if (!(ping = task_spawn(test_runnext_ping, c, 0)) ||
+	    !(pong = task_spawn(test_runnext_pong, c, 0)))
+		BUG_ON();
+	while (__sync_fetch_and_add(&test_runnext_trips, 0) < 1000)
+		yield();
+	__sync_fetch_and_add(&test_runnext_stop, 1);
+	if (task_join(ping, &n) < 0 || task_join(pong, NULL) < 0)
+		BUG_ON();
+	if ((long)n < 1000)
+		BUG_ON();
+	chan_free(c[0]);
+	chan_free(c[1]);
+	fprintf(stdout, "test_runnext ok: %ld\n", (long)n);
+}
+
+static int test_preempt_stop;
+
+void *test_preempt_hog(void *args) {
+	long n = 0;
+
+	// never blocks, only the time slice gets it off the thread
+	while (!__sync_fetch_and_add(&test_preempt_stop, 0)) {
+		n++;
+		task_safepoint();
+	}
+	return (void *)n;
+}
+
+static int test_preempt_spinstop;
+
+// no call at all, the signal stops it in the loop, with its registers
+// kept for it
+void *test_preempt_spin(void *args) {
+	volatile int *stop = &test_preempt_spinstop;
+	long n = 0;
+	double x = 0;
+
+	while (!*stop) {
+		n++;
+		x += 1.0;
+	}
+	if (x != (double)n)
+		BUG_ON();
+	return (void *)n;
+}
+
+void test_preempt(void *args) {
+	task_t *hogs[64];
+	int i, n = task_setmaxprocs(0) + 1;
+
+	if (n > 64)
+		n = 64;
+	// more hogs than threads, we get back here by preemption only
+	for (i = 0; i < n; i++)
+		if (!(hogs[i] = task_spawn(test_preempt_hog, NULL, 0)))
+			BUG_ON();
+	task_sleep(1000000);
+	__sync_fetch_and_add(&test_preempt_stop, 1);
+	for (i = 0; i < n; i++)
+		if (task_join(hogs[i], NULL) < 0)
+			BUG_ON();
+	// only the signal gets them off, the UCONTEXT build can't
+	if (!task_async_preempt()) {
+		fprintf(stdout, "test_preempt ok: no async\n");
+		return;
+	}
+	for (i = 0; i < n; i++)
+		if (!(hogs[i] = task_spawn(test_preempt_spin, NULL, 0)))
+			BUG_ON();
+	task_sleep(20000000);
+	__sync_fetch_and_add(&test_preempt_spinstop, 1);
+	for (i = 0; i < n; i++)
+		if (task_join(hogs[i], NULL) < 0)
+			BUG_ON();
+	fprintf(stdout, "test_preempt ok\n");
+}
+
+static int test_blocking_inflight;
+
+// Blocks its thread until another one blocks too, or gives up after 2s
+static void *test_blocking_nap(void *args) {
+	int i;
+
+	__sync_add_and_fetch(&test_blocking_inflight, 1);
+	for (i = 0; i < 2000 && __sync_fetch_and_add(&test_blocking_inflight, 0) < 2; i++)
+		usleep(1000);
+	return i < 2000 ? args : NULL;
+}
+
+void *test_blocking_foo(void *args) {
+	return task_blocking(test_blocking_nap, args);
+}
+
+void test_blocking(void *args) {
+	task_t *t[8];
+	struct addrinfo hints, *ai;
+	struct stat st;
+	long i;
+
+	// the naps only return if they overlap on the pool
+	for (i = 0; i < 8; i++)
+		if (!(t[i] = task_spawn(test_blocking_foo, (void *)(i + 1), 0)))
+			BUG_ON();
+	for (i = 0; i < 8; i++)
+		if (task_join(t[i], &args) < 0 || (long)args != i + 1)
+			BUG_ON();
+
+	if (sys_stat("/", &st) < 0 || !S_ISDIR(st.st_mode))
+		BUG_ON();
+	if (sys_stat("/nonexistent/gogo", &st) == 0 || errno != ENOENT)
+		BUG_ON();
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_socktype = SOCK_STREAM;
+	if (sys_getaddrinfo("127.0.0.1", "80", &hints, &ai) != 0)
+		BUG_ON();
+	freeaddrinfo(ai);
+	fprintf(stdout, "test_blocking ok\n");
+}
+
+static int test_handoff_go;
+
+// Blocks its thread in the kernel, not through the wrappers
+void *test_handoff_blocker(void *args) {
+	int i;
+
+	for (i = 0; i < 5000 && !__sync_fetch_and_add(&test_handoff_go, 0); i++)
+		usleep(1000);
+	return (void *)(long)(i < 5000);
+}
+
+void test_handoff(void *args) {
+	task_t *t[64];
+	int i, n = task_setmaxprocs(0);
+
+	if (n > 64)
+		n = 64;
+	// a blocker on every thread, only the spare threads get us back
+	for (i = 0; i < n; i++)
+		if (!(t[i] = task_spawn(test_handoff_blocker, NULL, 0)))
+			BUG_ON();
+	task_sleep(1000000);
+	__sync_fetch_and_add(&test_handoff_go, 1);
+	for (i = 0; i < n; i++)
+		if (task_join(t[i], &args) < 0 || !args)
+			BUG_ON();
+	fprintf(stdout, "test_handoff ok\n");
+}
+
+static void test_parallel_square(long begin, long end, void *args) {
+	long *v = args;
+
+	for (; begin < end; begin++)
+		v[begin] = begin * begin;
+}
+
+static void test_parallel_sum(long begin, long end, void *result, void *args) {
+	long *v = args;
+
+	for (; begin < end; begin++)
+		*(long *)result += v[begin];
+}
+
+static void test_parallel_join(void *result, const void *other, void *args) {
+	*(long *)result += *(const long *)other;
+}
+
+void test_parallel(void *args) {
+	long i, n = 100000, sum = 0, expect = 0;
+	long *v;
+
+	if (!(v = malloc(n * sizeof(long))))
+		BUG_ON();
+	if (task_parallel_for(0, n, 0, test_parallel_square, v) < 0)
+		BUG_ON();
+	for (i = 0; i < n; i++) {
+		if (v[i] != i * i)
+			BUG_ON();
+		expect += i * i;
+	}
+	if (task_parallel_reduce(0, n, 1000, &sum, sizeof(sum), test_parallel_sum,
+				 test_parallel_join, v) < 0 || sum != expect)
+		BUG_ON();
+	free(v);
+	fprintf(stdout, "test_parallel ok\n");
+}
+
+static int test_group_fds[2];
+static int test_group_cancelled;
+
+// A member spawned by a member, it's in the group too
+void test_group_yielder(void *args) {
+	while (yield() == 0)
+		;
+	if (errno != ECANCELED)
+		BUG_ON();
+	__sync_add_and_fetch(&test_group_cancelled, 1);
+}
+
+void test_group_member(void *args) {
+	char c;
+
+	switch ((long)args % 3) {
+	case 0:
+		// nobody writes, only the cancel wakes it up
+		if (sys_read(test_group_fds[0], &c, 1) != -1 || errno != ECANCELED)
+			BUG_ON();
+		break;
+	case 1:
+		if (task_sleep(10000000000LL) != -1 || errno != ECANCELED)
+			BUG_ON();
+		break;
+	case 2:
+		gogo(test_group_yielder, NULL);
+		break;
+	}
+	__sync_add_and_fetch(&test_group_cancelled, 1);
+}
+
+void test_group(void *args) {
+	struct task_group *g;
+	long long start;
+	long i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, test_group_fds) < 0)
+		BUG_ON();
+	fcntl(test_group_fds[0], F_SETFL, O_NONBLOCK);
+	if (!(g = task_group_make()))
+		BUG_ON();
+	for (i = 0; i < 30; i++)
+		if (task_group_spawn(g, test_group_member, (void *)i, 0) < 0)
+			BUG_ON();
+	task_sleep(1000000);
+	if (task_cancelled())
+		BUG_ON();
+	start = task_now();
+	task_group_cancel(g);
+	task_group_wait(g);
+	if (test_group_cancelled != 40 || task_now() - start > 5000000000LL)
+		BUG_ON();
+	task_group_free(g);
+	sys_close(test_group_fds[0]);
+	sys_close(test_group_fds[1]);
+	fprintf(stdout, "test_group ok\n");
+}
+
+static int test_deadline_fds[2];
+static int test_deadline_done;
+
+// Inherits the deadline of its spawner
+void test_deadline_reader(void *args) {
+	char c;
+
+	if (task_deadline() != (long long)(long)args)
+		BUG_ON();
+	if (sys_read(test_deadline_fds[0], &c, 1) != -1 || errno != ETIMEDOUT)
+		BUG_ON();
+	__sync_add_and_fetch(&test_deadline_done, 1);
+}
+
+void test_deadline(void *args) {
+	struct stat st;
+	struct pollfd pfd;
+	long long when, start = task_now();
+	char c;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, test_deadline_fds) < 0)
+		BUG_ON();
+	fcntl(test_deadline_fds[0], F_SETFL, O_NONBLOCK);
+	if (task_deadline() != -1)
+		BUG_ON();
+	when = start + 20000000;
+	task_setdeadline(when);
+	gogo(test_deadline_reader, (void *)(long)when);
+	if (sys_read(test_deadline_fds[0], &c, 1) != -1 || errno != ETIMEDOUT)
+		BUG_ON();
+	if (task_now() < when || task_now() - start > 5000000000LL)
+		BUG_ON();
+	if (sys_stat("/", &st) != -1 || errno != ETIMEDOUT)
+		BUG_ON();
+	pfd.fd = test_deadline_fds[0];
+	pfd.events = POLLIN;
+	if (sys_poll(&pfd, 1, -1) != -1 || errno != ETIMEDOUT)
+		BUG_ON();
+	if (sys_poll(&pfd, 1, 1000) != -1 || errno != ETIMEDOUT)
+		BUG_ON();
+	if (task_setdeadline(-1) != when || sys_stat("/", &st) < 0)
+		BUG_ON();
+	if (sys_poll(&pfd, 1, 1) != 0)
+		BUG_ON();
+	while (!__sync_fetch_and_add(&test_deadline_done, 0))
+		task_sleep(1000000);
+	sys_close(test_deadline_fds[0]);
+	sys_close(test_deadline_fds[1]);
+	fprintf(stdout, "test_deadline ok\n");
+}
+
+static int test_prio_rank;
+static long test_prio_ranks[TASK_PRIO_LEVELS];
+
+void test_prio_foo(void *args) {
+	int i;
+
+	if (task_getpriority(NULL) != (long)args)
+		BUG_ON();
+	for (i = 0; i < 100; i++)
+		yield();
+	__sync_add_and_fetch(&test_prio_ranks[(long)args],
+			     __sync_add_and_fetch(&test_prio_rank, 1));
+}
+
+void test_prio(void *args) {
+	long i, prio;
+
+	if (task_setpriority(NULL, TASK_PRIO_LEVELS) != -1 || errno != EINVAL)
+		BUG_ON();
+	// the low ones age up and finish too, but mostly last
+	for (i = 0; i < 200; i++) {
+		prio = i % 2 ? TASK_PRIO_LOW : TASK_PRIO_HIGH;
+		if (task_create_prio(test_prio_foo, (void *)prio, 0, prio) < 0)
+			BUG_ON();
+	}
+	while (__sync_fetch_and_add(&test_prio_rank, 0) != 200)
+		task_sleep(1000000);
+	if (test_prio_ranks[TASK_PRIO_HIGH] >= test_prio_ranks[TASK_PRIO_LOW])
+		BUG_ON();
+	fprintf(stdout, "test_prio ok\n");
+}
+
+void test_affinity(void *args) {
+	int on = task_setaffinity(-1);
+
+	if (on != (getenv("GOGOAFFINITY") && atoi(getenv("GOGOAFFINITY")) > 0))
+		BUG_ON();
+	// only before task_main
+	if (task_setaffinity(!on) != -1 || errno != EBUSY || task_setaffinity(on) != on)
+		BUG_ON();
+	fprintf(stdout, "test_affinity ok\n");
+}
+
+static long test_batch_sum;
+
+void test_batch_foo(void *args) {
+	yield();
+	__sync_add_and_fetch(&test_batch_sum, (long)args);
+}
+
+void test_batch(void *args) {
+	void (*funcs[1000])(void *);
+	void *argv[1000];
+	long i, limit = 1000;
+
+	// overflows the local run queue, the rest is spliced into the
+	// global queue at once.
+	for (i = 0; i < limit; i++) {
+		funcs[i] = test_batch_foo;
+		argv[i] = (void *)i;
+	}
+	if (task_create_batch(funcs, argv, limit, 0) != limit)
+		BUG_ON();
+	while (__sync_fetch_and_add(&test_batch_sum, 0) != limit * (limit - 1) / 2)
+		yield();
+	fprintf(stdout, "test_batch ok\n");
 }
 
 int task_main(struct task_args *args) {
@@ -104,6 +1036,30 @@ int task_main(struct task_args *args) {
 	//gogo(test_sizeclass, NULL);
 	//gogo(test_mem, NULL);
 	gogo(test_gogo, NULL);
+	gogo(test_gogo_cached, NULL);
+	gogo(test_steal, NULL);
+	gogo(test_maxprocs, NULL);
+	gogo(test_deepstack, NULL);
+	gogo(test_manytasks, NULL);
+	gogo(test_netpoll, NULL);
+	gogo(test_uring, NULL);
+	gogo(test_poll, NULL);
+	gogo(test_sleep, NULL);
+	gogo(test_chan, NULL);
+	gogo(test_select, NULL);
+	gogo(test_sync, NULL);
+	gogo(test_join, NULL);
+	gogo(test_coroutine, NULL);
+	gogo(test_batch, NULL);
+	gogo(test_runnext, NULL);
+	gogo(test_preempt, NULL);
+	gogo(test_blocking, NULL);
+	gogo(test_handoff, NULL);
+	gogo(test_parallel, NULL);
+	gogo(test_group, NULL);
+	gogo(test_deadline, NULL);
+	gogo(test_prio, NULL);
+	gogo(test_affinity, NULL);
 	return 0;
 }
 
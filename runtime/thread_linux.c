@@ -0,0 +1,145 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Thread state from the kernel, for the monitor thread, and the cpu
+// placement of the scheduler threads.
+
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "runtime.h"
+
+
+int sys_gettid(void) {
+	return syscall(SYS_gettid);
+}
+
+// Whether the thread tid sleeps in the kernel, in a syscall or waiting
+// for the disk, rather than running or runnable.
+int sys_thread_blocked(int tid) {
+	char path[64], buf[256], *p;
+	int fd, n;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = 0;
+	// the state follows the command name, which may contain anything
+	if (!(p = strrchr(buf, ')')) || p[1] != ' ')
+		return 0;
+	return p[2] == 'S' || p[2] == 'D';
+}
+
+
+// The cpus the process may run on, sorted by NUMA node so that the
+// threads with consecutive ids fill up a node before the next one. the
+// node of a cpu comes from sysfs, it's 0 for all without NUMA.
+static struct {
+	cpu_set_t mask;		// of the process at startup
+	int n;
+	int cpu[CPU_SETSIZE];
+	int node[CPU_SETSIZE];
+} topo;
+
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+static int topo_inited;
+
+// Set the cpus of a sysfs cpulist like "0-3,8-11" in set.
+static void cpulist_parse(const char *buf, cpu_set_t *set) {
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*buf) {
+		lo = strtol(buf, &end, 10);
+		if (end == buf)
+			break;
+		hi = lo;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		if (*end != ',')
+			break;
+		buf = end + 1;
+	}
+}
+
+static void topo_init(void) {
+	int nodeof[CPU_SETSIZE], cpu, node, maxnode = 0, fd, n;
+	char path[300], buf[4096];
+	struct dirent *de;
+	cpu_set_t set;
+	DIR *dir;
+
+	if (sched_getaffinity(0, sizeof(topo.mask), &topo.mask) < 0)
+		return;
+	memset(nodeof, 0, sizeof(nodeof));
+	if ((dir = opendir("/sys/devices/system/node"))) {
+		while ((de = readdir(dir))) {
+			if (sscanf(de->d_name, "node%d", &node) != 1)
+				continue;
+			snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+				 de->d_name);
+			if ((fd = open(path, O_RDONLY)) < 0)
+				continue;
+			n = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			if (n <= 0)
+				continue;
+			buf[n] = 0;
+			cpulist_parse(buf, &set);
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &set))
+					nodeof[cpu] = node;
+			if (node > maxnode)
+				maxnode = node;
+		}
+		closedir(dir);
+	}
+	for (node = 0; node <= maxnode; node++) {
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &topo.mask) || nodeof[cpu] != node)
+				continue;
+			topo.cpu[topo.n] = cpu;
+			topo.node[topo.n] = node;
+			topo.n++;
+		}
+	}
+	atomic_store(&topo_inited, 1);
+}
+
+// The cpu for the scheduler thread id and its node in *node, -1 if the
+// topology is unknown.
+int sys_cpu_pick(int id, int *node) {
+	pthread_once(&topo_once, topo_init);
+	if (!atomic_load(&topo_inited) || !topo.n)
+		return -1;
+	*node = topo.node[id % topo.n];
+	return topo.cpu[id % topo.n];
+}
+
+int sys_thread_bind(int cpu) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+// Let the calling thread run on all the cpus of the process again, the
+// threads created by a bound thread inherit its cpu.
+void sys_thread_unbind(void) {
+	if (atomic_load(&topo_inited))
+		sched_setaffinity(0, sizeof(topo.mask), &topo.mask);
+}
@@ -0,0 +1,264 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// Timers, a binary min heap of deadlines per thread. a timer goes on
+// the heap of the thread which adds it, the thread runs its expired
+// timers between the switches, the idle threads run the others', and
+// the idle thread polling the network sleeps no longer than the nearest
+// deadline of all the heaps. the callbacks run on the scheduler stack,
+// without the heap lock.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "task.h"
+#include "runtime.h"
+
+#define TIMER_IDLE 0
+#define TIMER_WAITING 1
+#define TIMER_RUNNING 2
+
+long long nanotime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void timers_init(struct timers *ts) {
+	spinlock_init(ts);
+	ts->heap = NULL;
+	ts->n = ts->cap = 0;
+	ts->next = -1;
+}
+
+void timers_destroy(struct timers *ts) {
+	spinlock_destroy(ts);
+	free(ts->heap);
+}
+
+static void siftup(struct timers *ts, int i) {
+	struct timer *tm = ts->heap[i];
+	int p;
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (ts->heap[p]->when <= tm->when)
+			break;
+		ts->heap[i] = ts->heap[p];
+		ts->heap[i]->index = i;
+		i = p;
+	}
+	ts->heap[i] = tm;
+	tm->index = i;
+}
+
+static void siftdown(struct timers *ts, int i) {
+	struct timer *tm = ts->heap[i];
+	int c;
+
+	while ((c = 2 * i + 1) < ts->n) {
+		if (c + 1 < ts->n && ts->heap[c + 1]->when < ts->heap[c]->when)
+			c++;
+		if (tm->when <= ts->heap[c]->when)
+			break;
+		ts->heap[i] = ts->heap[c];
+		ts->heap[i]->index = i;
+		i = c;
+	}
+	ts->heap[i] = tm;
+	tm->index = i;
+}
+
+static void heap_del(struct timers *ts, int i) {
+	int last = --ts->n;
+
+	ts->heap[i]->index = -1;
+	if (i != last) {
+		ts->heap[i] = ts->heap[last];
+		ts->heap[i]->index = i;
+		siftup(ts, i);
+		siftdown(ts, ts->heap[i]->index);
+	}
+	atomic_store(&ts->next, ts->n ? ts->heap[0]->when : -1);
+}
+
+// Start tm on the heap of the current thread, f(tm, arg) is called
+// once tm->when has passed.
+int timer_add(struct timer *tm) {
+	struct timers *ts = timers_local();
+	struct timer **heap;
+	int earliest;
+
+	tm->ts = NULL;
+	if (!ts) {
+		errno = EINVAL;
+		return -1;
+	}
+	spin_lock(ts);
+	if (ts->n == ts->cap) {
+		heap = realloc(ts->heap, sizeof(*heap) * (ts->cap ? ts->cap * 2 : 64));
+		if (!heap) {
+			spin_unlock(ts);
+			errno = ENOMEM;
+			return -1;
+		}
+		ts->heap = heap;
+		ts->cap = ts->cap ? ts->cap * 2 : 64;
+	}
+	tm->status = TIMER_WAITING;
+	tm->ts = ts;
+	ts->heap[ts->n++] = tm;
+	siftup(ts, ts->n - 1);
+	earliest = tm->index == 0;
+	atomic_store(&ts->next, ts->heap[0]->when);
+	spin_unlock(ts);
+
+	// the poller may sleep longer than the new deadline
+	if (earliest)
+		timer_wakeup();
+	return 0;
+}
+
+// Stop tm, returns 1 if it's stopped before firing. if the callback is
+// running, wait for it to finish, tm may be freed after return.
+int timer_del(struct timer *tm) {
+	struct timers *ts = tm->ts;
+
+	if (!ts)
+		return 0;	// never started
+	spin_lock(ts);
+	if (tm->status == TIMER_WAITING) {
+		heap_del(ts, tm->index);
+		tm->status = TIMER_IDLE;
+		spin_unlock(ts);
+		return 1;
+	}
+	spin_unlock(ts);
+	while (atomic_load(&tm->status) == TIMER_RUNNING)
+		cpu_relax();
+	return 0;
+}
+
+// The nearest deadline on ts, -1 if there is no timer.
+long long timers_next(struct timers *ts) {
+	return atomic_load(&ts->next);
+}
+
+// Run the expired timers of ts, return the number of them.
+int timers_run(struct timers *ts, long long now) {
+	struct timer *tm;
+	long long next;
+	int n = 0;
+
+	if ((next = atomic_load(&ts->next)) < 0 || next > now)
+		return 0;
+	spin_lock(ts);
+	while (ts->n && ts->heap[0]->when <= now) {
+		tm = ts->heap[0];
+		heap_del(ts, 0);
+		atomic_store(&tm->status, TIMER_RUNNING);
+		spin_unlock(ts);
+		tm->f(tm, tm->arg);
+		atomic_store(&tm->status, TIMER_IDLE);
+		n++;
+		spin_lock(ts);
+	}
+	spin_unlock(ts);
+	return n;
+}
+
+
+struct sleeper {
+	struct timer tm;
+	struct task *t;
+	int woken;		// by the timer or a cancel, whichever comes first
+	int err;		// of timer_add
+	struct cancelwait cw;
+};
+
+static void sleep_wakeup(struct timer *tm, void *arg) {
+	struct sleeper *s = arg;
+
+	(void)tm;
+	if (!atomic_xchg(&s->woken, 1))
+		task_ready(s->t);
+}
+
+static void sleep_cancel(void *arg) {
+	sleep_wakeup(NULL, arg);
+}
+
+// Arm the timer once the sleeper is parked, so the wakeup can't come
+// before the context is saved. the timer goes first, once the cancel
+// can wake the task s may be gone.
+static int sleep_commit(struct task *t, void *arg) {
+	struct sleeper *s = arg;
+
+	if (timer_add(&s->tm) < 0) {
+		s->err = errno;
+		return 0;
+	}
+	if (group_cancelwait_add(t, &s->cw) == 0)
+		return 1;
+	// cancelled already. unless the timer has readied the task, which
+	// may be running elsewhere now, take the wakeup and stop the timer.
+	if (atomic_xchg(&s->woken, 1))
+		return 1;
+	timer_del(&s->tm);
+	return 0;
+}
+
+int task_sleep_until(long long when) {
+	struct sleeper s;
+
+	if (when <= nanotime())
+		return task_yield();
+	s.t = task_current();
+	s.tm.when = when;
+	s.tm.f = sleep_wakeup;
+	s.tm.arg = &s;
+	s.tm.ts = NULL;
+	s.woken = 0;
+	s.err = 0;
+	INIT_LIST_HEAD(&s.cw.link);
+	s.cw.cancel = sleep_cancel;
+	s.cw.arg = &s;
+	task_park(sleep_commit, &s);
+	timer_del(&s.tm);
+	group_cancelwait_del(s.t, &s.cw);
+	if (s.err) {
+		errno = s.err;
+		return -1;
+	}
+	if (task_cancelled()) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+int task_sleep(long long ns) {
+	return task_sleep_until(nanotime() + ns);
+}
+
+long long task_now(void) {
+	return nanotime();
+}
+
+long long task_setdeadline(long long when) {
+	struct task *t = task_current();
+	long long old;
+
+	if (!t)
+		return -1;
+	old = t->deadline;
+	t->deadline = when < 0 ? -1 : when;
+	return old;
+}
+
+long long task_deadline(void) {
+	struct task *t = task_current();
+
+	return t ? t->deadline : -1;
+}
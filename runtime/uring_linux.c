@@ -0,0 +1,233 @@
+/* Copyright (c) 2013 Dong Fang, MIT; see COPYRIGHT */
+
+// io_uring backend for the file I/O
+//
+// O_NONBLOCK has no effect on regular files, a read missing the page
+// cache blocks the whole thread. the file wrappers submit the request
+// to the io_uring of the current thread instead, and park the task.
+// the ring fd is watched by the netpoller, so the completions are
+// reaped by whichever thread polls next and the tasks are made runnable
+// there. a thread submits only to its own ring, the completion queue is
+// shared under the ring lock. if io_uring is not available, uring_rw
+// declines and the wrappers take the readiness path.
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "task.h"
+#include "runtime.h"
+
+#define URING_ENTRIES 256
+
+struct uring {
+	// Lock must be the first field, it protects the completion queue
+	struct spinlock Lock;
+	int fd;
+	unsigned int entries;
+	int inflight;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sqring, *cqring;
+	size_t sqsize, cqsize;
+};
+
+struct uring_req {
+	struct task *task;
+	struct uring *ring;
+	struct io_uring_sqe sqe;
+	long long res;
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static int uring_disabled;
+static unsigned int uring_features;
+
+static void uring_key_init(void) {
+	if (pthread_key_create(&uring_key, NULL) != 0)
+		uring_disabled = 1;
+}
+
+// Reap the completions, called by netpoll when the ring fd is readable.
+static void uring_reap(void *arg) {
+	struct uring *ring = arg;
+	struct io_uring_cqe *cqe;
+	struct uring_req *req;
+	unsigned int head, tail;
+
+	spin_lock(ring);
+	head = *ring->cq_head;
+	tail = atomic_load(ring->cq_tail);
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		req = (struct uring_req *)(unsigned long)cqe->user_data;
+		req->res = cqe->res;
+		atomic_sub(&ring->inflight, 1);
+		netpoll_hold(-1);
+		task_ready(req->task);
+	}
+	atomic_store(ring->cq_head, head);
+	spin_unlock(ring);
+}
+
+static void uring_free(struct uring *ring) {
+	if (ring->sqes)
+		munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cqring && ring->cqring != ring->sqring)
+		munmap(ring->cqring, ring->cqsize);
+	if (ring->sqring)
+		munmap(ring->sqring, ring->sqsize);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
+
+static struct uring *uring_create(void) {
+	struct io_uring_params p;
+	struct uring *ring;
+	char *sq, *cq;
+
+	if (!(ring = malloc(sizeof(*ring))))
+		return NULL;
+	memset(ring, 0, sizeof(*ring));
+	spinlock_init(ring);
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+		goto ERROR;
+	uring_features = p.features;
+	ring->entries = p.sq_entries;
+
+	ring->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqsize > ring->sqsize)
+			ring->sqsize = ring->cqsize;
+		ring->cqsize = ring->sqsize;
+	}
+	sq = mmap(NULL, ring->sqsize, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto ERROR;
+	ring->sqring = sq;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, ring->cqsize, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto ERROR;
+	}
+	ring->cqring = cq;
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto ERROR;
+	}
+
+	ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	if (netpoll_watch(ring->fd, uring_reap, ring) < 0)
+		goto ERROR;
+	return ring;
+ ERROR:
+	uring_free(ring);
+	return NULL;
+}
+
+// The ring of the current thread, created on the first use. NULL if
+// io_uring is not available.
+static struct uring *uring_get(void) {
+	struct uring *ring;
+
+	if (atomic_load(&uring_disabled))
+		return NULL;
+	pthread_once(&uring_once, uring_key_init);
+	if ((ring = pthread_getspecific(uring_key)))
+		return ring;
+	if (!(ring = uring_create())) {
+		// ENOSYS, EPERM by seccomp, no memory... don't retry.
+		atomic_store(&uring_disabled, 1);
+		return NULL;
+	}
+	pthread_setspecific(uring_key, ring);
+	return ring;
+}
+
+// Runs on the scheduler stack once the task is parked, so the
+// completion can't make it runnable before its context is saved.
+static int uring_submit(struct task *t, void *arg) {
+	struct uring_req *req = arg;
+	struct uring *ring = req->ring;
+	unsigned int tail, idx;
+	int ret;
+
+	(void)t;
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	ring->sqes[idx] = req->sqe;
+	ring->sq_array[idx] = idx;
+	atomic_store(ring->sq_tail, tail + 1);
+
+	atomic_add(&ring->inflight, 1);
+	netpoll_hold(1);
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret == 1)
+		return 1;
+
+	// not consumed, take it back and resume the task with the error
+	atomic_store(ring->sq_tail, tail);
+	atomic_sub(&ring->inflight, 1);
+	netpoll_hold(-1);
+	req->res = ret < 0 ? -errno : -EAGAIN;
+	return 0;
+}
+
+// Read ('r') or write ('w') iov at offset of fd through the io_uring of
+// the current thread, offset -1 means the file position. returns 0 if
+// io_uring can't take the request, otherwise the result of the syscall
+// is stored into *res, -errno on error.
+int uring_rw(int op, int fd, const struct iovec *iov, int iovcnt,
+	     long long offset, long long *res) {
+	struct uring_req req;
+	struct uring *ring;
+
+	if (!task_current() || !(ring = uring_get()))
+		return 0;
+	if (offset < 0 && !(uring_features & IORING_FEAT_RW_CUR_POS))
+		return 0;
+	if ((unsigned int)atomic_load(&ring->inflight) >= ring->entries)
+		return 0;
+
+	memset(&req, 0, sizeof(req));
+	req.task = task_current();
+	req.ring = ring;
+	req.sqe.opcode = op == 'r' ? IORING_OP_READV : IORING_OP_WRITEV;
+	req.sqe.fd = fd;
+	req.sqe.off = (unsigned long long)offset;
+	req.sqe.addr = (unsigned long)iov;
+	req.sqe.len = iovcnt;
+	req.sqe.user_data = (unsigned long)&req;
+	task_park(uring_submit, &req);
+	*res = req.res;
+	return 1;
+}